@@ -0,0 +1,29 @@
+#!/bin/sh
+# Generate a large input file.
+#
+# USAGE: bench/gen.sh <file> <MB> [lines|line]
+#
+# lines: numbered lines of 64 bytes, the numbers going round every 2^20 lines,
+#        then the line `MARKER` and the line `last line`. The size is rounded
+#        down to a multiple of 64 MB.
+# line:  a single line of <MB> MB, without a final newline.
+set -e
+
+FILE=$1
+MB=$2
+MODE=${3:-lines}
+
+if [ "$MODE" = line ]; then
+    head -c $((MB << 20)) /dev/zero | tr '\0' 'x' > "$FILE"
+    exit 0
+fi
+
+awk 'BEGIN {
+    fill = "the quick brown fox jumps over the lazy dog 0123456789"
+    for (i = 0; i < 1048576; i += 1) printf "%08d %s\n", i, fill
+}' > "$FILE.block"
+
+: > "$FILE"
+for i in $(seq $((MB / 64))); do cat "$FILE.block" >> "$FILE"; done
+rm "$FILE.block"
+printf 'MARKER\nlast line\n' >> "$FILE"
@@ -0,0 +1,74 @@
+#!/bin/sh
+# Edit and save generated files past 2^31 bytes headless, then check the
+# saved bytes against the original: rows, cursor, search and save have to
+# use 64-bit sizes all the way.
+#
+# USAGE: bench/large.sh <editor executable> <work directory> [MB] [line MB]
+#
+# The file of many lines takes MB, the single line `line MB` (MB by default).
+# Once edited and shown the line is held several times in memory, as chars,
+# render and hl: about five times its size with the sanitized build.
+set -e
+
+EXEC=$1
+WORK=$2
+MB=${3:-2240}
+LINE_MB=${4:-$MB}
+SIZE=50x160
+
+mkdir -p "$WORK"
+DIR=$(dirname "$0")
+
+# keys
+CTRL_E='\005'
+CTRL_F='\006'
+CTRL_S='\023'
+END='\033[F'
+HOME='\033[H'
+ENTER='\r'
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+size() {
+    wc -c < "$1" | tr -d ' '
+}
+
+# many lines: edit the first one, the one found by a search past 2 GB and the
+# last one reached with Ctrl-E.
+sh "$DIR/gen.sh" "$WORK/lines.txt" "$MB" lines
+cp "$WORK/lines.txt" "$WORK/lines.orig"
+{
+    printf 'HEAD'
+    printf "${CTRL_F}MARKER$ENTER"
+    printf 'X'
+    printf "$CTRL_E$END"
+    printf 'TAIL'
+    printf "$CTRL_S"
+} > "$WORK/lines.keys"
+echo "== lines ($(size "$WORK/lines.orig") bytes)"
+"$EXEC" --replay "$WORK/lines.keys" --size "$SIZE" "$WORK/lines.txt"
+
+ORIG=$(size "$WORK/lines.orig")
+[ "$(size "$WORK/lines.txt")" -eq $((ORIG + 9)) ] || fail "lines: size"
+[ "$(head -c 4 "$WORK/lines.txt")" = HEAD ] || fail "lines: first row"
+[ "$(tail -n 2 "$WORK/lines.txt" | tr '\n' '|')" = "XMARKER|last lineTAIL|" ] || fail "lines: last rows"
+cmp -s -i 4:0 -n $((ORIG - 17)) "$WORK/lines.txt" "$WORK/lines.orig" || fail "lines: content"
+echo "ok"
+rm -f "$WORK/lines.txt" "$WORK/lines.orig"
+
+# a single line longer than 2^31 bytes: edit both of its ends.
+sh "$DIR/gen.sh" "$WORK/line.txt" "$LINE_MB" line
+ORIG=$(size "$WORK/line.txt")
+printf "${END}TAIL${HOME}HEAD$CTRL_S" > "$WORK/line.keys"
+echo "== line ($ORIG bytes)"
+"$EXEC" --replay "$WORK/line.keys" --size "$SIZE" "$WORK/line.txt"
+
+[ "$(size "$WORK/line.txt")" -eq $((ORIG + 9)) ] || fail "line: size"
+[ "$(head -c 4 "$WORK/line.txt")" = HEAD ] || fail "line: start"
+[ "$(tail -c 5 "$WORK/line.txt")" = TAIL ] || fail "line: end"
+head -c "$ORIG" /dev/zero | tr '\0' 'x' | cmp -s -i 4:0 -n "$ORIG" "$WORK/line.txt" - || fail "line: content"
+echo "ok"
+rm -f "$WORK/line.txt"
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Replay the benchmark scenarios headless and print a report for each.
+#
+# USAGE: bench/run.sh <editor executable> <work directory>
+set -e
+
+EXEC=$1
+WORK=$2
+SIZE=50x160
+
+mkdir -p "$WORK"
+
+# inputs: a copy of the sources and a ~20 MB file made of it.
+cp src/main.c "$WORK/small.c"
+: > "$WORK/large.c"
+for i in $(seq 200); do cat src/main.c >> "$WORK/large.c"; done
+
+# keys
+DOWN='\033[B'
+UP='\033[A'
+PAGE_DOWN='\033[6~'
+CTRL_E='\005'
+CTRL_F='\006'
+CTRL_R='\022'
+CTRL_S='\023'
+ENTER='\r'
+
+scenario() {
+    name=$1
+    file=$2
+    shift 2
+    echo "== $name"
+    "$EXEC" --replay "$WORK/$name.keys" --size "$SIZE" "$@" "$file"
+}
+
+# open the large file and scroll through its start.
+for i in $(seq 2000); do printf "$DOWN"; done > "$WORK/open.keys"
+scenario open "$WORK/large.c"
+
+# type the first 300 lines of the sources in the middle of a file.
+{
+    for i in $(seq 1000); do printf "$DOWN"; done
+    head -n 300 src/main.c | tr '\n' '\r'
+} > "$WORK/type.keys"
+scenario type "$WORK/small.c"
+
+# paste the sources ten times as one bracketed paste, then scroll down.
+{
+    printf '\033[200~'
+    for i in $(seq 10); do cat src/main.c; done
+    printf '\033[201~'
+    for i in $(seq 200); do printf "$DOWN"; done
+} > "$WORK/paste.keys"
+scenario paste "$WORK/small.c"
+
+# search the large file, the query typed a key at a time.
+{
+    printf "$CTRL_F"
+    printf 'editor_row_insert'
+    printf "$ENTER"
+    printf "$CTRL_F"
+    printf 'find_state'
+    printf "$ENTER"
+} > "$WORK/search.keys"
+scenario search "$WORK/large.c"
+
+# search the large file for a regex, typed a key at a time: the literal of the
+# pattern skips most lines.
+{
+    printf "$CTRL_F$CTRL_R"
+    printf 'editor_row_(insert|delete)_\\w+'
+    printf "$ENTER"
+} > "$WORK/regex.keys"
+scenario regex "$WORK/large.c"
+
+# edit the large file and save it.
+printf "/* saved */$ENTER$CTRL_S" > "$WORK/save.keys"
+scenario save "$WORK/large.c"
+
+# page through the large file read-only, jump to its end and search back from
+# there, with a cache smaller than the file.
+{
+    for i in $(seq 500); do printf "$PAGE_DOWN"; done
+    printf "$CTRL_E"
+    printf "$CTRL_F"
+    printf 'editor_row_insert'
+    printf "$UP$UP$UP"
+    printf "$ENTER"
+} > "$WORK/pager.keys"
+scenario pager "$WORK/large.c" --pager --cache 8
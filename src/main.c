@@ -7,17 +7,31 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*
  * Multiline 
  * comment
@@ -28,7 +42,28 @@
 
 #define EDITOR_VERSION    "0.0.1"
 #define EDITOR_TAB_STOP   8
+// Chars between two checkpoints of a row's column index.
+#define EDITOR_COL_STRIDE 4096
 #define EDITOR_QUIT_TIMES 1
+// Rows past the bottom of the screen whose lexer state is computed ahead.
+#define EDITOR_HL_MARGIN  16
+// Rows whose lexer state may need recomputing after an edit are queued, the
+// ones past the screen being worked off between key presses.
+#define EDITOR_HL_PENDING_MAX 32
+#define EDITOR_HL_SLICE       1024
+// Input is read this many bytes at a time.
+#define EDITOR_INPUT_CHUNK    4096
+// How long to wait for the rest of an escape sequence.
+#define EDITOR_ESCAPE_MS      100
+// Status messages go away after this long.
+#define EDITOR_MSG_MS         5000
+// Frames are drawn at most this many times a second by default (`--fps`),
+// the ones asked for sooner being coalesced.
+#define EDITOR_FPS_MAX        120
+// How often the match count is refreshed while a search runs.
+#define EDITOR_FIND_PROGRESS_MS 100
+// How often the progress is refreshed while the file is being indexed.
+#define EDITOR_LOAD_PROGRESS_MS 100
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -42,7 +77,9 @@ typedef enum Editor_Key {
     PAGE_DOWN,
     HOME_KEY,
     END_KEY,
-    DEL_KEY
+    DEL_KEY,
+    // Start of a bracketed paste, the pasted text follows up to `\x1b[201~`.
+    PASTE_START
 } Editor_Key;
 
 typedef enum Editor_Highlight {
@@ -56,43 +93,211 @@ typedef enum Editor_Highlight {
     HL_MATCH
 } Editor_Highlight;
 
+// Lexer state carried from the end of a row to the start of the next one.
+typedef enum Editor_Hl_State {
+    HL_STATE_NORMAL = 0,
+    HL_STATE_COMMENT
+} Editor_Hl_State;
+
+// Row operations recorded in the undo journal, see `undo_record`.
+typedef enum Undo_Type {
+    UNDO_MARK = 0,
+    UNDO_INSERT_TEXT,
+    UNDO_DELETE_TEXT,
+    UNDO_INSERT_ROW,
+    UNDO_DELETE_ROW
+} Undo_Type;
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
 /*** data ***/
 
+typedef struct Keyword_Slot {
+    const char*   word;
+    int           len;
+    unsigned char hl;
+} Keyword_Slot;
+
+// `keywords` compiled into a perfect hash: every keyword has a slot of its
+// own, so a lookup is a single probe whatever the size of the list.
+typedef struct Keyword_Table {
+    uint32_t      seed;
+    uint32_t      mask;
+    int           max_len;
+    Keyword_Slot* slots;
+} Keyword_Table;
+
 typedef struct Editor_Syntax {
-    char*  file_type;
-    char** file_match;
-    char** keywords;
-    char*  singleline_comment_start;
-    char*  multiline_comment_start;
-    char*  multiline_comment_end;
-    int    flags;
+    char*         file_type;
+    char**        file_match;
+    char**        keywords;
+    char*         singleline_comment_start;
+    char*         multiline_comment_start;
+    char*         multiline_comment_end;
+    int           flags;
+    // Built by `editor_syntax_compile` when the syntax is first selected.
+    Keyword_Table keyword_table;
 } Editor_Syntax;
 
+// A row is a 16 byte handle, everything derived from its chars for display
+// lives in a `Row_Cache` of its own and its lexer state in a bit of its leaf.
+// Rows never displayed, most of them in a large file, cost the handle alone.
 typedef struct Editor_Row {
-    int            idx;
-    int            size;
-    int            render_size;
+    // Points into `editor_state.map` until the row is first modified, see
+    // `editor_row_detach`. Only owned chars are NUL-terminated.
     char*          chars;
+    int64_t        size;
+} Editor_Row;
+
+typedef struct Row_Cache {
+    int64_t        render_size;
     char*          render;
+    // Built on first display from `render` and the lexer state, NULL until
+    // then.
     unsigned char* hl;
-    int            hl_open_comment;
-} Editor_Row;
+    // Render offset of every EDITOR_COL_STRIDE-th char, the first
+    // `cols_count` being valid. Only long rows get one, see
+    // `editor_row_col_checkpoint`.
+    int64_t*       cols;
+    int64_t        cols_count;
+    int64_t        cols_cap;
+} Row_Cache;
+
+// Rows live in the leaves of a B+ tree where every node knows how many rows
+// its subtree holds. Looking up, inserting or deleting a row only walks one
+// root-to-leaf path, and a row number is derived from the counts instead of
+// being stored in (and renumbered across) every row.
+#define ROW_TREE_LEAF_CAP 128
+#define ROW_TREE_FANOUT   32
+
+typedef struct Row_Node {
+    struct Row_Node* parent;
+    // Leaves are chained in file order, these are NULL for inner nodes.
+    struct Row_Node* prev;
+    struct Row_Node* next;
+    bool             is_leaf;
+    // Number of children for an inner node, number of rows for a leaf.
+    int              count;
+    int64_t          rows_total;
+    struct Row_Node* children[ROW_TREE_FANOUT];
+    Editor_Row*      rows;
+    // Cache of each row, the array only being allocated once a row of the
+    // leaf gets one.
+    Row_Cache**      caches;
+    // Lexer state at the start of each row, a bit per row: only meaningful
+    // for the rows before `editor_state.hl_synced`.
+    uint64_t         hl_states[ROW_TREE_LEAF_CAP / 64];
+} Row_Node;
+
+typedef struct Row_Iter {
+    Row_Node* leaf;
+    int       at;
+} Row_Iter;
+
+// Offsets of the lines of the open file, found by a thread reading through
+// it while the first screens are already shown, see `line_index_start`. Only
+// the offset of one line in LINE_INDEX_STRIDE is kept.
+#define LINE_INDEX_STRIDE 4096
+// Bytes mapped at a time when reading through the file.
+#define LINE_INDEX_CHUNK  (64 << 20)
+// Bytes read between two reports of the progress.
+#define LINE_INDEX_SLICE  (1 << 20)
+
+typedef struct Line_Index {
+    pthread_t       thread;
+    bool            running;
+    // Owned by the thread, closed when it is done.
+    int             fd;
+    int64_t         file_size;
+    // Offset of lines 0, LINE_INDEX_STRIDE, 2 * LINE_INDEX_STRIDE... Sized
+    // for the most lines the file can hold, only the pages written to take
+    // memory. Entries before `offsets_count` are final.
+    int64_t*        offsets;
+    _Atomic int64_t offsets_count;
+    // Bytes read through so far, the newlines found in them and the offset
+    // past the last one.
+    _Atomic int64_t scanned;
+    _Atomic int64_t new_lines;
+    _Atomic int64_t line_start;
+    // Set once the file was read to the end, `partial_last` before it.
+    atomic_bool     done;
+    // Asks the thread to stop, see `line_index_free`.
+    atomic_bool     cancel;
+    bool            partial_last;
+    pthread_mutex_t lock;
+    pthread_cond_t  progress;
+    // Blocks of LINE_INDEX_STRIDE lines loaded in the row tree so far, see
+    // `editor_load_block`. Left alone by the pager.
+    int64_t         blocks_loaded;
+    bool            loading;
+} Line_Index;
+
+// The one of the current buffer, see `line_index_new`.
+Line_Index* line_index = NULL;
+
+// Read-only view of a file too large to be loaded, see `pager_open`. The
+// file is cut in blocks of the lines between two offsets of the line index.
+// A block in use is mapped on its own and holds rows, caches and lexer
+// states like a leaf of the row tree.
+#define PAGER_BLOCK_LINES     LINE_INDEX_STRIDE
+#define EDITOR_PAGER_CACHE_MB 256
+// Bytes mapped at a time when searching the file.
+#define PAGER_SCAN_CHUNK      (64 << 20)
+
+typedef struct Pager_Block {
+    int64_t      index;
+    char*        map;
+    size_t       map_size;
+    // File offset of the start of the mapping.
+    int64_t      map_offset;
+    int          rows_count;
+    Editor_Row*  rows;
+    Row_Cache**  caches;
+    // Lexer state at the start of the first `hl_synced` rows. Every block
+    // starts in the normal state, a comment spanning two blocks isn't
+    // carried over.
+    uint64_t     hl_states[PAGER_BLOCK_LINES / 64];
+    int          hl_synced;
+    // Memory held, counted against `pager.cache_max`.
+    int64_t      bytes;
+    int64_t      used_at;
+} Pager_Block;
+
+typedef struct Pager {
+    bool         enabled;
+    int          fd;
+    int64_t      file_size;
+    Pager_Block** blocks;
+    int           blocks_count;
+    int64_t      cache_bytes;
+    int64_t      cache_max;
+    int64_t      clock;
+    // Where the search started and the offset of its current match.
+    int64_t      find_from;
+    int64_t      find_match;
+} Pager;
+
+Pager pager = { .fd = -1, .cache_max = (int64_t) EDITOR_PAGER_CACHE_MB << 20 };
 
 typedef struct Editor_State {
-    int            cursor_x, cursor_y;
-    int            render_x;
-    int            row_offset, col_offset;
+    int64_t        cursor_x, cursor_y;
+    int64_t        render_x;
+    int64_t        row_offset, col_offset;
     int            screen_rows;
     int            screen_cols;
-    int            rows_count;
-    Editor_Row*    rows;
+    int64_t        rows_count;
+    int64_t        chars_total;
+    Row_Node*      rows;
+    char*          map;
+    size_t         map_size;
+    int64_t        hl_synced;
+    int64_t        hl_pending[EDITOR_HL_PENDING_MAX];
+    int            hl_pending_count;
     int            dirty;
     char*          filename;
     char           status_msg[80];
-    time_t         status_msg_time;
+    long           status_msg_time;
     Editor_Syntax* syntax;
     struct termios original_termios;
 } Editor_State;
@@ -111,7 +316,7 @@ char* c_hl_keywords[]   = {
 };
 
 Editor_Syntax HLDB[] = {
-    {"c", c_hl_extensions, c_hl_keywords, "//", "/*", "*/", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+    {"c", c_hl_extensions, c_hl_keywords, "//", "/*", "*/", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, { 0 } },
 };
 
 #define HLDB_COUNT (sizeof(HLDB) / sizeof(HLDB[0]))
@@ -120,7 +325,29 @@ Editor_Syntax HLDB[] = {
 
 void editor_set_status_msg(const char* fmt, ...);
 void editorRefreshScreen(void);
+void editor_refresh_screen(void);
 char* editor_prompt(char* prompt, void (*callback)(char*, int));
+void editor_wait_input(void);
+void* row_store_alloc(size_t size);
+void row_store_free(void* block, size_t size);
+void* row_store_realloc(void* block, size_t old_size, size_t new_size);
+Row_Cache** row_leaf_caches_new(void);
+void row_leaf_caches_free(Row_Cache** caches);
+void undo_record(int type, int64_t row, int64_t col, const char* data, int64_t len);
+void swap_record(int type, int64_t row, int64_t col, const char* data, int64_t len);
+void swap_discard(void);
+void buffers_discard_swaps(void);
+Editor_Row* pager_row_at(int64_t at);
+Row_Cache* pager_row_cache(int64_t at);
+Row_Cache* pager_row_cache_peek(int64_t at);
+Editor_Row* pager_row_rendered(int64_t at, Row_Cache** cache);
+void pager_find_start(void);
+void pager_find_callback(char* query, int key);
+bool pager_open(char* filename);
+void pager_sync_rows(void);
+void pager_index_until(int64_t lines, int64_t offset);
+bool find_running(void);
+const char* find_memmem(const char* hay, int64_t hay_len, const char* needle, int needle_len);
 
 /*** terminal ***/
 
@@ -135,6 +362,9 @@ void die(const char* s) {
 }
 
 void disable_raw_mode(void) {
+    // disable bracketed paste.
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
+
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &editor_state.original_termios) == -1) {
         die("`tcsetattr` fail when disabling raw mode");
     }
@@ -163,52 +393,399 @@ void enable_raw_mode(void) {
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
 
-    // Sets the minimum number of bytes of input needed before read() can return.
-    raw.c_cc[VMIN] = 0;
-    // Sets the maximum amount of time to wait before read() returns (is is in tenths of a second).
-    raw.c_cc[VTIME] = 1;
+    // read() never blocks, waiting for input is done with poll(), see
+    // `editor_wait_input`.
+    raw.c_cc[VMIN]  = 0;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         die("`tcsetattr` fail when enabling raw mode");
     }
+
+    // enable bracketed paste, pasted text comes between `\x1b[200~` and `\x1b[201~`.
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editor_read_key(void) {
-    int read_count;
-    char c;
+long editor_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-    while ((read_count = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (read_count == -1 && errno != EAGAIN) {
-            die("Error while reading input");
-        }
+// Anything that needs the event loop to look again (a resize, a search
+// worker being done) writes a byte to this pipe, see `editor_wait_input`.
+int editor_wake_pipe[2] = { -1, -1 };
+volatile sig_atomic_t editor_resized = 0;
+
+// Safe to call from a signal handler or another thread.
+void editor_wake(void) {
+    int saved_errno = errno;
+    // a full pipe has the loop woken up already.
+    write(editor_wake_pipe[1], "w", 1);
+    errno = saved_errno;
+}
+
+void editor_wake_drain(void) {
+    char drain[64];
+    while (read(editor_wake_pipe[0], drain, sizeof(drain)) > 0);
+}
+
+void handle_sigwinch(int sig) {
+    (void) sig;
+    editor_resized = 1;
+    editor_wake();
+}
+
+void enable_wake_events(void) {
+    if (pipe(editor_wake_pipe) == -1) {
+        die("`pipe` fail when enabling wake events");
+    }
+    fcntl(editor_wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(editor_wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    struct sigaction action = { 0 };
+    action.sa_handler = handle_sigwinch;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGWINCH, &action, NULL) == -1) {
+        die("`sigaction` fail when enabling wake events");
+    }
+}
+
+/*** replay ***/
+
+// Headless mode: keys are read from a script instead of the terminal, frames
+// are drawn to /dev/null and every key is timed from being read until the
+// next one is asked for, its frame included. A report is printed on exit.
+typedef struct Replay_Samples {
+    int64_t* items;
+    int64_t  count;
+    int64_t  cap;
+} Replay_Samples;
+
+typedef struct Replay_State {
+    bool           enabled;
+    int            rows;
+    int            cols;
+    FILE*          report;
+    // Microseconds, -1 while no key is being handled.
+    int64_t        key_start;
+    int64_t        open_us;
+    Replay_Samples latency;
+    Replay_Samples frame_bytes;
+} Replay_State;
+
+Replay_State replay = { .key_start = -1 };
+
+int64_t editor_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void replay_samples_push(Replay_Samples* samples, int64_t value) {
+    if (samples->count == samples->cap) {
+        samples->cap   = samples->cap ? samples->cap * 2 : 1024;
+        samples->items = realloc(samples->items, sizeof(int64_t) * samples->cap);
+        if (samples->items == NULL) die("Error while recording a replay sample");
+    }
+
+    samples->items[samples->count]  = value;
+    samples->count                 += 1;
+}
+
+int replay_samples_cmp(const void* a, const void* b) {
+    int64_t x = *(const int64_t*) a;
+    int64_t y = *(const int64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Sorts the samples.
+int64_t replay_samples_percentile(Replay_Samples* samples, int percent) {
+    if (samples->count == 0) return 0;
+
+    qsort(samples->items, samples->count, sizeof(int64_t), replay_samples_cmp);
+    return samples->items[(samples->count - 1) * percent / 100];
+}
+
+void replay_key_start(void) {
+    if (replay.enabled) replay.key_start = editor_now_us();
+}
+
+void replay_key_end(void) {
+    if (!replay.enabled || replay.key_start < 0) return;
+
+    replay_samples_push(&replay.latency, editor_now_us() - replay.key_start);
+    replay.key_start = -1;
+}
+
+void replay_report(void) {
+    Replay_Samples* latency = &replay.latency;
+    Replay_Samples* bytes   = &replay.frame_bytes;
+
+    int64_t bytes_total = 0;
+    for (int64_t i = 0; i < bytes->count; i += 1) {
+        bytes_total += bytes->items[i];
+    }
+
+    fprintf(replay.report, "open     %.3f ms\n", replay.open_us / 1000.0);
+    fprintf(replay.report, "keys     %" PRId64 "\n", latency->count);
+    fprintf(replay.report, "latency  p50 %.3f ms  p99 %.3f ms  max %.3f ms\n",
+        replay_samples_percentile(latency, 50) / 1000.0,
+        replay_samples_percentile(latency, 99) / 1000.0,
+        replay_samples_percentile(latency, 100) / 1000.0);
+    fprintf(replay.report, "frames   %" PRId64 "\n", bytes->count);
+    fprintf(replay.report, "bytes    p50 %" PRId64 "  p99 %" PRId64 "  max %" PRId64 "  mean %" PRId64 " per frame\n",
+        replay_samples_percentile(bytes, 50),
+        replay_samples_percentile(bytes, 99),
+        replay_samples_percentile(bytes, 100),
+        bytes->count ? bytes_total / bytes->count : 0);
+    fflush(replay.report);
+}
+
+// Take keys from `script` and draw to /dev/null on a `size` ("<rows>x<cols>")
+// terminal, the report going to the original stdout.
+void replay_start(const char* script, const char* size) {
+    replay.enabled = true;
+    replay.rows    = 24;
+    replay.cols    = 80;
+    if (size && (sscanf(size, "%dx%d", &replay.rows, &replay.cols) != 2 || replay.rows < 3 || replay.cols < 1)) {
+        fprintf(stderr, "Invalid terminal size `%s`, expected <rows>x<cols>\n", size);
+        exit(1);
+    }
+
+    int script_fd = open(script, O_RDONLY);
+    int null_fd   = open("/dev/null", O_WRONLY);
+    if (script_fd == -1 || null_fd == -1) {
+        perror(script);
+        exit(1);
+    }
+
+    replay.report = fdopen(dup(STDOUT_FILENO), "w");
+    if (replay.report == NULL || dup2(script_fd, STDIN_FILENO) == -1 || dup2(null_fd, STDOUT_FILENO) == -1) {
+        perror("Error while starting replay");
+        exit(1);
+    }
+    close(script_fd);
+    close(null_fd);
+
+    atexit(replay_report);
+    // a replay ending is the editor being closed, not crashing.
+    atexit(buffers_discard_swaps);
+}
+
+/*** profile ***/
+
+// Hot paths are timed and counted while the overlay (Ctrl-T) is shown or a
+// trace is being written (`--trace <file>`), costing a branch otherwise.
+typedef enum Prof_Phase {
+    PROF_READ_KEY = 0,
+    PROF_KEY,
+    PROF_SYNTAX,
+    PROF_DRAW_ROWS,
+    PROF_WRITE,
+    PROF_LOAD,
+    PROF_PHASES
+} Prof_Phase;
+
+typedef enum Prof_Counter {
+    PROF_ALLOCS = 0,
+    PROF_BYTES_WRITTEN,
+    PROF_COUNTERS
+} Prof_Counter;
+
+const char* prof_phase_names[PROF_PHASES] = { "read_key", "key", "syntax", "draw_rows", "write", "load" };
+
+typedef struct Profile {
+    bool    enabled;
+    bool    overlay;
+    // Chrome trace event file, see `prof_trace_start`.
+    FILE*   trace;
+    int64_t trace_events;
+    // Microseconds, 0 while no key is being handled.
+    int64_t key_start;
+    // Accumulated over the frame being built, then moved to `last_*` once it
+    // is written.
+    int64_t time[PROF_PHASES];
+    int64_t counters[PROF_COUNTERS];
+    int64_t last_time[PROF_PHASES];
+    int64_t last_counters[PROF_COUNTERS];
+} Profile;
+
+Profile prof = { 0 };
+
+void prof_update_enabled(void) {
+    prof.enabled = prof.overlay || prof.trace != NULL;
+}
+
+// Start of a timed phase, 0 when profiling is off.
+int64_t prof_begin(void) {
+    return prof.enabled ? editor_now_us() : 0;
+}
+
+void prof_trace_event(const char* name, int64_t ts, int64_t dur) {
+    fprintf(prof.trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRId64 ",\"pid\":1,\"tid\":1}",
+        prof.trace_events ? ",\n" : "", name, ts, dur);
+    prof.trace_events += 1;
+}
+
+void prof_end(Prof_Phase phase, int64_t start) {
+    if (start == 0) return;
+
+    int64_t dur = editor_now_us() - start;
+    prof.time[phase] += dur;
+    if (prof.trace) prof_trace_event(prof_phase_names[phase], start, dur);
+}
+
+void prof_count(Prof_Counter counter, int64_t n) {
+    if (prof.enabled) prof.counters[counter] += n;
+}
+
+// The key phase runs from a key being read to the next frame or key, so the
+// time spent in a prompt waiting for keys isn't counted.
+void prof_key_start(void) {
+    prof.key_start = prof_begin();
+}
+
+void prof_key_end(void) {
+    prof_end(PROF_KEY, prof.key_start);
+    prof.key_start = 0;
+}
+
+void prof_frame_end(void) {
+    if (!prof.enabled) return;
+
+    if (prof.trace) {
+        fprintf(prof.trace, "%s{\"name\":\"frame\",\"ph\":\"C\",\"ts\":%" PRId64 ",\"pid\":1,\"tid\":1,\"args\":{\"allocs\":%" PRId64 ",\"bytes\":%" PRId64 "}}",
+            prof.trace_events ? ",\n" : "", editor_now_us(), prof.counters[PROF_ALLOCS], prof.counters[PROF_BYTES_WRITTEN]);
+        prof.trace_events += 1;
+    }
+
+    memcpy(prof.last_time, prof.time, sizeof(prof.time));
+    memcpy(prof.last_counters, prof.counters, sizeof(prof.counters));
+    memset(prof.time, 0, sizeof(prof.time));
+    memset(prof.counters, 0, sizeof(prof.counters));
+}
+
+void prof_toggle_overlay(void) {
+    prof.overlay = !prof.overlay;
+    prof_update_enabled();
+}
+
+void prof_trace_end(void) {
+    fprintf(prof.trace, "\n]\n");
+    fclose(prof.trace);
+    prof.trace = NULL;
+    prof_update_enabled();
+}
+
+// Trace events go to `path` in the Chrome trace format (JSON array), which
+// chrome://tracing and Perfetto open. The file is completed on exit.
+void prof_trace_start(const char* path) {
+    prof.trace = fopen(path, "w");
+    if (prof.trace == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(prof.trace, "[\n");
+    prof_update_enabled();
+    atexit(prof_trace_end);
+}
+
+// Input is read a chunk at a time and handed out byte by byte, so a burst of
+// keys costs one `read` instead of one per byte.
+typedef struct Input_Buf {
+    char b[EDITOR_INPUT_CHUNK];
+    int  len;
+    int  at;
+} Input_Buf;
+
+Input_Buf input_buf = { 0 };
+
+// Make sure input is buffered, waiting for it at most `timeout` ms. False
+// when none came in time.
+bool editor_input_fill(int timeout) {
+    if (input_buf.at < input_buf.len) return true;
+
+    struct pollfd stdin_poll = { .fd = STDIN_FILENO, .events = POLLIN };
+    int ready = poll(&stdin_poll, 1, timeout);
+    if (ready == -1 && errno != EINTR) {
+        die("Error while waiting for input");
+    }
+    if (ready <= 0) return false;
+
+    int read_count = read(STDIN_FILENO, input_buf.b, sizeof(input_buf.b));
+    if (read_count == -1 && errno != EAGAIN && errno != EINTR) {
+        die("Error while reading input");
     }
+    // readable yet empty, the terminal is gone, or the replay is over.
+    if (read_count == 0 && replay.enabled) exit(0);
+    if (read_count == 0) die("Input closed");
+    if (read_count <= 0) return false;
+
+    input_buf.len = read_count;
+    input_buf.at  = 0;
+    return true;
+}
+
+// Next byte of a key already being read. False when none came within
+// EDITOR_ESCAPE_MS.
+bool editor_read_byte(char* c) {
+    if (!editor_input_fill(EDITOR_ESCAPE_MS)) return false;
+
+    *c = input_buf.b[input_buf.at];
+    input_buf.at += 1;
+    return true;
+}
+
+// Whether a key is already waiting, in which case the screen is not redrawn
+// until it has been handled.
+bool editor_input_pending(void) {
+    // a replay draws a frame after every key, as if they were typed.
+    if (replay.enabled) return false;
+
+    struct pollfd stdin_poll = { .fd = STDIN_FILENO, .events = POLLIN };
+    return input_buf.at < input_buf.len || poll(&stdin_poll, 1, 0) > 0;
+}
+
+// Decode the key starting at the next byte of input, which must be there.
+int editor_decode_key(void) {
+    char c;
+    if (!editor_read_byte(&c)) return '\x1b';
 
     // Mapp arrow keys to hjkl.
     if (c == '\x1b') {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (!editor_read_byte(&seq[0])) return '\x1b';
+        if (!editor_read_byte(&seq[1])) return '\x1b';
 
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                // `\x1b[<n>~`, the number having one digit or more.
+                int n = seq[1] - '0';
+                while (true) {
+                    if (!editor_read_byte(&seq[2])) return '\x1b';
+                    if (seq[2] < '0' || seq[2] > '9') break;
+                    n = n * 10 + seq[2] - '0';
+                }
                 if(seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
+                    switch (n) {
+                        case 1: return HOME_KEY;
+                        case 3: return DEL_KEY;
+                        case 4: return END_KEY;
+                        case 5: return PAGE_UP;
+                        case 6: return PAGE_DOWN;
+                        case 7: return HOME_KEY;
+                        case 8: return END_KEY;
+                        case 200: return PASTE_START;
                     }
                 }
             } else {
                 switch(seq[1]) {
-                    case 'A': return MOVE_DOWN;
-                    case 'B': return MOVE_UP;
+                    case 'A': return MOVE_UP;
+                    case 'B': return MOVE_DOWN;
                     case 'C': return MOVE_RIGHT;
                     case 'D': return MOVE_LEFT;
                     case 'H': return HOME_KEY;
@@ -228,6 +805,22 @@ int editor_read_key(void) {
     }
 }
 
+int editor_read_key(void) {
+    replay_key_end();
+    prof_key_end();
+    while (!editor_input_fill(0)) {
+        editor_wait_input();
+    }
+
+    int64_t prof_start = prof_begin();
+    int c = editor_decode_key();
+    prof_end(PROF_READ_KEY, prof_start);
+
+    replay_key_start();
+    prof_key_start();
+    return c;
+}
+
 bool get_cursor_position(int* rows, int* cols) {
     char buf[32];
     unsigned int i = 0;
@@ -237,7 +830,7 @@ bool get_cursor_position(int* rows, int* cols) {
     }
 
     while(i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+        if (!editor_read_byte(&buf[i])) {
             break;
         }
 
@@ -278,517 +871,4720 @@ bool get_window_size(int* rows, int* cols) {
     }
 }
 
-/*** syntax highlighting ***/
+/*** row tree ***/
 
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+// Nodes come out of the row store like the rows they hold, see
+// `row_store_release`.
+Row_Node* row_node_new(bool is_leaf) {
+    Row_Node* node = row_store_alloc(sizeof(Row_Node));
+    *node = (Row_Node) { .is_leaf = is_leaf };
+    if (is_leaf) node->rows = row_store_alloc(sizeof(Editor_Row) * ROW_TREE_LEAF_CAP);
+
+    return node;
 }
 
-void editor_update_syntax(Editor_Row* row) {
-    row->hl = realloc(row->hl, row->render_size);
-    memset(row->hl, HL_NORMAL, row->render_size);
+void row_node_free(Row_Node* node) {
+    if (node->rows) row_store_free(node->rows, sizeof(Editor_Row) * ROW_TREE_LEAF_CAP);
+    row_leaf_caches_free(node->caches);
+    row_store_free(node, sizeof(Row_Node));
+}
 
-    if (editor_state.syntax == NULL) return;
+// Lexer states are kept a bit per row.
+int hl_state_bit(const uint64_t* bits, int at) {
+    return (bits[at / 64] >> (at % 64)) & 1;
+}
 
-    char** keywords = editor_state.syntax->keywords;
+void hl_state_bit_set(uint64_t* bits, int at, int state) {
+    uint64_t bit = (uint64_t) 1 << (at % 64);
+    if (state == HL_STATE_COMMENT) {
+        bits[at / 64] |= bit;
+    } else {
+        bits[at / 64] &= ~bit;
+    }
+}
 
-    char* scs = editor_state.syntax->singleline_comment_start;
-    char* mcs = editor_state.syntax->multiline_comment_start;
-    char* mce = editor_state.syntax->multiline_comment_end;
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+int row_leaf_hl_state(Row_Node* leaf, int at) {
+    return hl_state_bit(leaf->hl_states, at);
+}
 
-    int prev_sep   = 1;
-    int in_string  = 0;
-    int in_comment = (row->idx > 0 && editor_state.rows[row->idx - 1].hl_open_comment);
+void row_leaf_set_hl_state(Row_Node* leaf, int at, int state) {
+    hl_state_bit_set(leaf->hl_states, at, state);
+}
 
-    int i = 0;
-    while(i < row->render_size) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+// Move `count` rows from `src_at` in `src` to `dst_at` in `dst`, along with
+// their cache and lexer state. Both may be the same leaf.
+void row_leaf_move(Row_Node* dst, int dst_at, Row_Node* src, int src_at, int count) {
+    if (count <= 0) return;
 
-        if(scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->render_size - i);
-                break;
-            }
-        }
+    memmove(&dst->rows[dst_at], &src->rows[src_at], sizeof(Editor_Row) * count);
 
-        if(mcs_len && mce_len && !in_string) {
-            if(in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i          += mce_len;
-                    in_comment  = 0;
-                    prev_sep    = 1;
-                    continue;
-                } else {
-                    i += 1;
-                    continue;
-                }
-            } else if(!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i          += mcs_len;
-                in_comment  = 1;
-                continue;
-            }
+    if (src->caches != NULL) {
+        if (dst->caches == NULL) dst->caches = row_leaf_caches_new();
+        memmove(&dst->caches[dst_at], &src->caches[src_at], sizeof(Row_Cache*) * count);
+    } else if (dst->caches != NULL) {
+        memset(&dst->caches[dst_at], 0, sizeof(Row_Cache*) * count);
+    }
+
+    // Bits go one at a time, backwards when moving right within a leaf.
+    if (dst == src && dst_at > src_at) {
+        for (int j = count - 1; j >= 0; j -= 1) {
+            row_leaf_set_hl_state(dst, dst_at + j, row_leaf_hl_state(src, src_at + j));
+        }
+    } else {
+        for (int j = 0; j < count; j += 1) {
+            row_leaf_set_hl_state(dst, dst_at + j, row_leaf_hl_state(src, src_at + j));
         }
+    }
+}
 
-        if (editor_state.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->render_size) {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if(c == in_string) in_string = 0;
-                i += 1;
-                prev_sep = 1;
-                continue;
-            } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i += 1;
-                    continue;
-                }
-            }
+// Descend to the leaf holding the row `at`, `leaf_at` receives its index in
+// that leaf. `at == rows_count` resolves to the end of the last leaf.
+Row_Node* row_tree_find_leaf(int64_t at, int* leaf_at) {
+    Row_Node* node = editor_state.rows;
+
+    while (!node->is_leaf) {
+        int j = 0;
+        while (j < node->count - 1 && at >= node->children[j]->rows_total) {
+            at -= node->children[j]->rows_total;
+            j += 1;
         }
+        node = node->children[j];
+    }
 
-        if (editor_state.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
-                i += 1;
-                prev_sep = 0;
-                continue;
-            }
+    *leaf_at = at;
+    return node;
+}
+
+int row_tree_child_index(Row_Node* parent, Row_Node* child) {
+    int j = 0;
+    while (parent->children[j] != child) j += 1;
+    return j;
+}
+
+void row_tree_adjust(Row_Node* node, int delta) {
+    for (; node != NULL; node = node->parent) {
+        node->rows_total += delta;
+    }
+}
+
+// Split `node` after its first `keep` entries, the rest moving to a new right
+// sibling which is returned. Full parents are split first so the totals along
+// the path stay correct at every step.
+Row_Node* row_tree_split(Row_Node* node, int keep) {
+    if (node->parent == NULL) {
+        Row_Node* root   = row_node_new(false);
+        root->children[0] = node;
+        root->count       = 1;
+        root->rows_total  = node->rows_total;
+        node->parent      = root;
+        editor_state.rows = root;
+    } else if (node->parent->count == ROW_TREE_FANOUT) {
+        row_tree_split(node->parent, ROW_TREE_FANOUT / 2);
+    }
+
+    Row_Node* right = row_node_new(node->is_leaf);
+    right->count    = node->count - keep;
+
+    if (node->is_leaf) {
+        row_leaf_move(right, 0, node, keep, right->count);
+        right->rows_total = right->count;
+
+        right->prev = node;
+        right->next = node->next;
+        if (node->next) node->next->prev = right;
+        node->next = right;
+    } else {
+        memcpy(right->children, &node->children[keep], sizeof(Row_Node*) * right->count);
+        for (int j = 0; j < right->count; j += 1) {
+            right->children[j]->parent  = right;
+            right->rows_total          += right->children[j]->rows_total;
         }
+    }
 
-        if(prev_sep) {
-            int j;
-            for(j = 0; keywords[j]; j += 1) {
-                int k_len = strlen(keywords[j]);
-                int kw2 = keywords[j][k_len - 1] == '|';
-                if (kw2) k_len -= 1;
-
-                if(!strncmp(&row->render[i], keywords[j], k_len) && is_separator(row->render[i + k_len])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, k_len);
-                    i += k_len;
-                    break;
-                }
-            }
+    node->count      = keep;
+    node->rows_total -= right->rows_total;
 
-            if(keywords[j] != NULL) {
-                prev_sep = 0;
-                continue;
-            }
+    Row_Node* parent = node->parent;
+    int j = row_tree_child_index(parent, node) + 1;
+    memmove(&parent->children[j + 1], &parent->children[j], sizeof(Row_Node*) * (parent->count - j));
+    parent->children[j]  = right;
+    parent->count       += 1;
+    right->parent        = parent;
+
+    return right;
+}
+
+// Unlink an empty node from the tree, along with any ancestor it leaves empty.
+void row_tree_remove_node(Row_Node* node) {
+    while (node->count == 0 && node->parent != NULL) {
+        Row_Node* parent = node->parent;
+        int j = row_tree_child_index(parent, node);
+        memmove(&parent->children[j], &parent->children[j + 1], sizeof(Row_Node*) * (parent->count - j - 1));
+        parent->count -= 1;
+
+        if (node->is_leaf) {
+            if (node->prev) node->prev->next = node->next;
+            if (node->next) node->next->prev = node->prev;
         }
 
-        prev_sep = is_separator(c);
-        i += 1;
+        row_node_free(node);
+        node = parent;
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < editor_state.rows_count) {
-        editor_update_syntax(&editor_state.rows[row->idx + 1]);
+    // Shrink the tree while the root is an inner node with a single child.
+    while (!editor_state.rows->is_leaf && editor_state.rows->count == 1) {
+        Row_Node* root    = editor_state.rows;
+        editor_state.rows = root->children[0];
+        editor_state.rows->parent = NULL;
+        row_node_free(root);
     }
 }
 
-int editor_syntax_to_color(int hl) {
-    switch (hl) {
-        case HL_COMMENT:
-        case HL_MLCOMMENT: return 36;
-        case HL_KEYWORD1:  return 33;
-        case HL_KEYWORD2:  return 32;
-        case HL_STRING:    return 35;
-        case HL_NUMBER:    return 31;
-        case HL_MATCH:     return 34;
-        default:           return 37;
+// Make room for a row at `at` starting in the lexer state `hl_state` and
+// return it, its content is left to the caller.
+Editor_Row* row_tree_insert(int64_t at, int hl_state) {
+    int leaf_at;
+    Row_Node* leaf = row_tree_find_leaf(at, &leaf_at);
+
+    if (leaf->count == ROW_TREE_LEAF_CAP) {
+        // Appending at the very end (like when loading a file) starts a fresh
+        // leaf instead of leaving two half-full ones behind.
+        int keep = (leaf->next == NULL && leaf_at == leaf->count) ? leaf->count : leaf->count / 2;
+        Row_Node* right = row_tree_split(leaf, keep);
+        if (leaf_at > keep || leaf->count == ROW_TREE_LEAF_CAP) {
+            leaf_at -= keep;
+            leaf     = right;
+        }
     }
+
+    row_leaf_move(leaf, leaf_at + 1, leaf, leaf_at, leaf->count - leaf_at);
+    if (leaf->caches) leaf->caches[leaf_at] = NULL;
+    row_leaf_set_hl_state(leaf, leaf_at, hl_state);
+    leaf->count += 1;
+    row_tree_adjust(leaf, 1);
+    editor_state.rows_count += 1;
+
+    return &leaf->rows[leaf_at];
 }
 
-void editor_select_syntax_highlight(void) {
-    editor_state.syntax = NULL;
-    if (editor_state.filename == NULL) return;
+// Drop the row at `at` from the tree, its content and cache must have been
+// freed.
+void row_tree_delete(int64_t at) {
+    int leaf_at;
+    Row_Node* leaf = row_tree_find_leaf(at, &leaf_at);
 
-    char* ext = strrchr(editor_state.filename, '.');
+    row_leaf_move(leaf, leaf_at, leaf, leaf_at + 1, leaf->count - leaf_at - 1);
+    leaf->count -= 1;
+    row_tree_adjust(leaf, -1);
+    editor_state.rows_count -= 1;
 
-    for(unsigned int j = 0; j < HLDB_COUNT; j += 1) {
-        Editor_Syntax* stx = &HLDB[j];
+    // Fold a sparse leaf into its right sibling when both fit in one.
+    Row_Node* next = leaf->next;
+    if (next && next->parent == leaf->parent && leaf->count + next->count <= ROW_TREE_LEAF_CAP / 2) {
+        row_leaf_move(leaf, leaf->count, next, 0, next->count);
+        leaf->count      += next->count;
+        leaf->rows_total += next->count;
+        next->rows_total  = 0;
+        next->count       = 0;
+        row_tree_remove_node(next);
+    } else if (leaf->count == 0 && (leaf->prev || leaf->next)) {
+        row_tree_remove_node(leaf);
+    }
+}
 
-        unsigned int i = 0;
-        while (stx->file_match[i]) {
-            int is_ext = (stx->file_match[i][0] == '.');
-            if ( (is_ext && ext && !strcmp(ext, stx->file_match[i])) || 
-                 (!is_ext && strstr(editor_state.filename, stx->file_match[i])) ) {
-                editor_state.syntax = stx;
+Editor_Row* editor_row_at(int64_t at) {
+    if (at < 0 || at >= editor_state.rows_count) return NULL;
+    if (pager.enabled) return pager_row_at(at);
 
-                for(int file_row = 0; file_row < editor_state.rows_count; file_row += 1) {
-                    editor_update_syntax(&editor_state.rows[file_row]);
-                }
+    int leaf_at;
+    Row_Node* leaf = row_tree_find_leaf(at, &leaf_at);
+    return &leaf->rows[leaf_at];
+}
 
-                return;
-            }
+Row_Iter row_iter_at(int64_t at) {
+    Row_Iter it;
+    it.leaf = row_tree_find_leaf(at, &it.at);
+    return it;
+}
 
-            i += 1;
-        }
+// Return the row under the iterator and step forward, NULL past the last row.
+Editor_Row* row_iter_next(Row_Iter* it) {
+    while (it->leaf && it->at >= it->leaf->count) {
+        it->leaf = it->leaf->next;
+        it->at   = 0;
     }
+    if (it->leaf == NULL) return NULL;
 
+    Editor_Row* row = &it->leaf->rows[it->at];
+    it->at += 1;
+    return row;
 }
 
-/*** row operation ***/
+// Lexer state of the row last returned by `row_iter_next`.
+int row_iter_hl_state(Row_Iter* it) {
+    return row_leaf_hl_state(it->leaf, it->at - 1);
+}
 
-int editor_row_cursor_x_to_render_x(Editor_Row* row, int cursor_x) {
-    int render_x = 0;
-    for (int j = 0; j < cursor_x; j += 1) {
-        if (row->chars[j] == '\t') {
-            render_x = (EDITOR_TAB_STOP - 1) - (render_x % EDITOR_TAB_STOP);
-        }
-        render_x += 1;
-    }
+void row_iter_set_hl_state(Row_Iter* it, int state) {
+    row_leaf_set_hl_state(it->leaf, it->at - 1, state);
+}
 
-    return render_x;
+// Cache of the row last returned by `row_iter_next`, NULL when it has none.
+Row_Cache* row_iter_cache(Row_Iter* it) {
+    return it->leaf->caches ? it->leaf->caches[it->at - 1] : NULL;
 }
 
-int editor_row_render_x_to_cursor_x(Editor_Row* row, int render_x) {
-    int curr_render_x = 0;
-    int cursor_x;
-    for (cursor_x = 0; cursor_x < row->size; cursor_x += 1) {
-        if (row->chars[cursor_x] == '\t') {
-            curr_render_x += (EDITOR_TAB_STOP - 1) - (curr_render_x % EDITOR_TAB_STOP);
-        }
-        curr_render_x += 1;
+int editor_row_hl_state(int64_t at) {
+    int leaf_at;
+    Row_Node* leaf = row_tree_find_leaf(at, &leaf_at);
+    return row_leaf_hl_state(leaf, leaf_at);
+}
 
-        if (curr_render_x > render_x) return cursor_x;
-    }
+/*** row storage ***/
+
+// Row chars, caches and tree nodes come out of size-classed slabs carved from
+// large chunks rather than a heap block each, freed blocks going on a free
+// list per class. Blocks are resized and freed with the size they were asked
+// for, which their owners always know, so they carry no header. Bigger blocks
+// are left to malloc and chained behind a small header. Every buffer has a
+// store of its own, which closing it gives back at once.
+#define ROW_STORE_CHUNK     (1 << 20)
+#define ROW_STORE_SMALL_MAX 4096
+#define ROW_STORE_CLASSES   20
+
+typedef struct Row_Store_Big {
+    struct Row_Store_Big* prev;
+    struct Row_Store_Big* next;
+} Row_Store_Big;
+
+typedef struct Row_Store {
+    void*          free_lists[ROW_STORE_CLASSES];
+    char**         chunks;
+    int            chunks_count;
+    int            chunks_cap;
+    // Unused end of the last chunk.
+    char*          at;
+    char*          end;
+    Row_Store_Big* bigs;
+    // Memory of the row caches in the store, kept as they are made, resized
+    // and freed. It adds up `row_cache_size` and the cache slots of leaves.
+    int64_t        cache_bytes;
+} Row_Store;
+
+Row_Store row_store = { 0 };
+
+// Sizes up to 256 bytes are rounded up to a multiple of 16, larger ones to a
+// power of two.
+int row_store_class(size_t size) {
+    if (size <= 16) return 0;
+    if (size <= 256) return (size + 15) / 16 - 1;
+    return 16 + (64 - __builtin_clzl(size - 1)) - 9;
+}
 
-    return cursor_x;
+size_t row_store_class_size(int class) {
+    return class < 16 ? (size_t) (class + 1) * 16 : (size_t) 512 << (class - 16);
+}
+
+void row_store_link_big(Row_Store_Big* big) {
+    big->prev = NULL;
+    big->next = row_store.bigs;
+    if (big->next) big->next->prev = big;
+    row_store.bigs = big;
 }
 
-void editor_update_row(Editor_Row* row) {
-    int tabs = 0;
-    for(int j = 0; j < row->size; j += 1) {
-        if (row->chars[j] == '\t') tabs =+ 1;
+void row_store_unlink_big(Row_Store_Big* big) {
+    if (big->prev) {
+        big->prev->next = big->next;
+    } else {
+        row_store.bigs = big->next;
     }
+    if (big->next) big->next->prev = big->prev;
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (EDITOR_TAB_STOP - 1) + 1);
+void* row_store_alloc(size_t size) {
+    if (size > ROW_STORE_SMALL_MAX) {
+        Row_Store_Big* big = malloc(sizeof(Row_Store_Big) + size);
+        if (big == NULL) die("Error while allocating a row");
+        row_store_link_big(big);
+        return big + 1;
+    }
 
-    int idx = 0;
-    for (int j = 0; j < row->size; j += 1) {
-        if (row->chars[j] == '\t') {
-            row->render[idx] = ' ';
-            while (idx % EDITOR_TAB_STOP != 0) {
-                row->render[idx] = ' ';
-                idx += 1;
+    int class = row_store_class(size);
+    void* block = row_store.free_lists[class];
+    if (block != NULL) {
+        row_store.free_lists[class] = *(void**) block;
+        return block;
+    }
+
+    size_t class_size = row_store_class_size(class);
+    if ((size_t) (row_store.end - row_store.at) < class_size) {
+        if (row_store.chunks_count == row_store.chunks_cap) {
+            row_store.chunks_cap = row_store.chunks_cap ? row_store.chunks_cap * 2 : 16;
+            row_store.chunks     = realloc(row_store.chunks, sizeof(char*) * row_store.chunks_cap);
+            if (row_store.chunks == NULL) die("Error while allocating a row");
+        }
+        char* chunk = malloc(ROW_STORE_CHUNK);
+        if (chunk == NULL) die("Error while allocating a row");
+        row_store.chunks[row_store.chunks_count]  = chunk;
+        row_store.chunks_count                   += 1;
+        row_store.at  = chunk;
+        row_store.end = chunk + ROW_STORE_CHUNK;
+    }
+
+    block         = row_store.at;
+    row_store.at += class_size;
+    return block;
+}
+
+void row_store_free(void* block, size_t size) {
+    if (block == NULL) return;
+    if (size > ROW_STORE_SMALL_MAX) {
+        Row_Store_Big* big = (Row_Store_Big*) block - 1;
+        row_store_unlink_big(big);
+        free(big);
+        return;
+    }
+
+    int class = row_store_class(size);
+    *(void**) block = row_store.free_lists[class];
+    row_store.free_lists[class] = block;
+}
+
+// Resizing within a size class keeps the block.
+void* row_store_realloc(void* block, size_t old_size, size_t new_size) {
+    if (block == NULL) return row_store_alloc(new_size);
+    if (old_size > ROW_STORE_SMALL_MAX && new_size > ROW_STORE_SMALL_MAX) {
+        Row_Store_Big* big = (Row_Store_Big*) block - 1;
+        row_store_unlink_big(big);
+        big = realloc(big, sizeof(Row_Store_Big) + new_size);
+        if (big == NULL) die("Error while allocating a row");
+        row_store_link_big(big);
+        return big + 1;
+    }
+    if (old_size <= ROW_STORE_SMALL_MAX && new_size <= ROW_STORE_SMALL_MAX
+        && row_store_class(old_size) == row_store_class(new_size)) {
+        return block;
+    }
+
+    void* moved = row_store_alloc(new_size);
+    memcpy(moved, block, old_size < new_size ? old_size : new_size);
+    row_store_free(block, old_size);
+    return moved;
+}
+
+// Give back everything allocated from `store`, whatever still uses it.
+void row_store_release(Row_Store* store) {
+    for (int j = 0; j < store->chunks_count; j += 1) {
+        free(store->chunks[j]);
+    }
+    free(store->chunks);
+
+    while (store->bigs != NULL) {
+        Row_Store_Big* big = store->bigs;
+        store->bigs = big->next;
+        free(big);
+    }
+
+    *store = (Row_Store) { 0 };
+}
+
+// A row's hl is as long as its render, and at least one byte.
+size_t editor_row_hl_size(Row_Cache* cache) {
+    return cache->render_size ? cache->render_size : 1;
+}
+
+void editor_row_drop_hl(Row_Cache* cache) {
+    if (cache == NULL || cache->hl == NULL) return;
+    row_store_free(cache->hl, editor_row_hl_size(cache));
+    row_store.cache_bytes -= editor_row_hl_size(cache);
+    cache->hl = NULL;
+}
+
+// An empty cache.
+Row_Cache* row_cache_new(void) {
+    Row_Cache* cache = row_store_alloc(sizeof(Row_Cache));
+    prof_count(PROF_ALLOCS, 1);
+    *cache = (Row_Cache) { 0 };
+    row_store.cache_bytes += sizeof(Row_Cache);
+    return cache;
+}
+
+// Cache slots of a leaf, all empty.
+Row_Cache** row_leaf_caches_new(void) {
+    Row_Cache** caches = row_store_alloc(sizeof(Row_Cache*) * ROW_TREE_LEAF_CAP);
+    memset(caches, 0, sizeof(Row_Cache*) * ROW_TREE_LEAF_CAP);
+    row_store.cache_bytes += sizeof(Row_Cache*) * ROW_TREE_LEAF_CAP;
+    return caches;
+}
+
+void row_leaf_caches_free(Row_Cache** caches) {
+    if (caches == NULL) return;
+    row_store_free(caches, sizeof(Row_Cache*) * ROW_TREE_LEAF_CAP);
+    row_store.cache_bytes -= sizeof(Row_Cache*) * ROW_TREE_LEAF_CAP;
+}
+
+// Cache of the row `at` in `leaf`, made empty when it has none yet.
+Row_Cache* row_leaf_cache(Row_Node* leaf, int at) {
+    if (leaf->caches == NULL) leaf->caches = row_leaf_caches_new();
+
+    if (leaf->caches[at] == NULL) leaf->caches[at] = row_cache_new();
+
+    return leaf->caches[at];
+}
+
+Row_Cache* editor_row_cache(int64_t at) {
+    if (pager.enabled) return pager_row_cache(at);
+
+    int leaf_at;
+    Row_Node* leaf = row_tree_find_leaf(at, &leaf_at);
+    return row_leaf_cache(leaf, leaf_at);
+}
+
+// Cache of the row `at`, NULL when it has none.
+Row_Cache* editor_row_cache_peek(int64_t at) {
+    if (pager.enabled) return pager_row_cache_peek(at);
+
+    int leaf_at;
+    Row_Node* leaf = row_tree_find_leaf(at, &leaf_at);
+    return leaf->caches ? leaf->caches[leaf_at] : NULL;
+}
+
+// Memory a cache holds, itself included.
+int64_t row_cache_size(Row_Cache* cache) {
+    int64_t size = sizeof(Row_Cache) + sizeof(int64_t) * cache->cols_cap;
+    if (cache->render) size += cache->render_size + 1;
+    if (cache->hl) size += editor_row_hl_size(cache);
+    return size;
+}
+
+// Free what a cache holds, and the cache itself.
+void row_cache_free(Row_Cache* cache) {
+    if (cache == NULL) return;
+
+    row_store.cache_bytes -= row_cache_size(cache);
+    if (cache->hl) row_store_free(cache->hl, editor_row_hl_size(cache));
+    if (cache->render) row_store_free(cache->render, cache->render_size + 1);
+    row_store_free(cache->cols, sizeof(int64_t) * cache->cols_cap);
+    row_store_free(cache, sizeof(Row_Cache));
+}
+
+// Free the caches of the tree under `node`. Lexer states are kept, nothing
+// else needs to be recomputed than what rows get displayed again.
+void row_tree_drop_caches(Row_Node* node) {
+    while (!node->is_leaf) node = node->children[0];
+
+    for (Row_Node* leaf = node; leaf != NULL; leaf = leaf->next) {
+        if (leaf->caches == NULL) continue;
+
+        for (int j = 0; j < leaf->count; j += 1) {
+            row_cache_free(leaf->caches[j]);
+        }
+        row_leaf_caches_free(leaf->caches);
+        leaf->caches = NULL;
+    }
+}
+
+void editor_row_cache_free(int64_t at) {
+    int leaf_at;
+    Row_Node* leaf = row_tree_find_leaf(at, &leaf_at);
+    if (leaf->caches == NULL) return;
+
+    row_cache_free(leaf->caches[leaf_at]);
+    leaf->caches[leaf_at] = NULL;
+}
+
+/*** syntax highlighting ***/
+
+static const bool separator_table[256] = {
+    ['\0'] = true, [' '] = true, ['\t'] = true, ['\n'] = true, ['\v'] = true, ['\f'] = true, ['\r'] = true,
+    [','] = true, ['.'] = true, ['('] = true, [')'] = true, ['+'] = true, ['-'] = true, ['/'] = true,
+    ['*'] = true, ['='] = true, ['~'] = true, ['%'] = true, ['<'] = true, ['>'] = true, ['['] = true,
+    [']'] = true, [';'] = true,
+};
+
+int is_separator(int c) {
+    return separator_table[(unsigned char) c];
+}
+
+uint32_t keyword_hash(uint32_t seed, const char* word, int len) {
+    uint32_t hash = seed ^ 2166136261u;
+    for (int i = 0; i < len; i += 1) {
+        hash = (hash ^ (unsigned char) word[i]) * 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+// Look up the word as a keyword, returning its highlight or HL_NORMAL.
+int keyword_lookup(Keyword_Table* table, const char* word, int len) {
+    if (len > table->max_len) return HL_NORMAL;
+
+    Keyword_Slot* slot = &table->slots[keyword_hash(table->seed, word, len) & table->mask];
+    if (slot->len == len && !memcmp(slot->word, word, len)) return slot->hl;
+    return HL_NORMAL;
+}
+
+// Find a seed under which no two keywords share a slot, growing the table
+// when too many seeds fail. Keywords ending with `|` are secondary ones.
+void editor_syntax_compile(Editor_Syntax* syntax) {
+    Keyword_Table* table = &syntax->keyword_table;
+    if (table->slots != NULL) return;
+
+    int count = 0;
+    while (syntax->keywords[count]) count += 1;
+
+    uint32_t size = 1;
+    while (size < (uint32_t) count * 2) size *= 2;
+
+    for (uint32_t seed = 0;; seed += 1) {
+        if (seed > 0 && seed % 64 == 0) size *= 2;
+
+        free(table->slots);
+        table->slots   = calloc(size, sizeof(Keyword_Slot));
+        table->seed    = seed;
+        table->mask    = size - 1;
+        table->max_len = 0;
+        if (table->slots == NULL) die("Error while building the keyword table");
+
+        int j;
+        for (j = 0; j < count; j += 1) {
+            char* word = syntax->keywords[j];
+            int len = strlen(word);
+            int kw2 = word[len - 1] == '|';
+            if (kw2) len -= 1;
+
+            Keyword_Slot* slot = &table->slots[keyword_hash(seed, word, len) & table->mask];
+            if (slot->word != NULL) break;
+
+            slot->word = word;
+            slot->len  = len;
+            slot->hl   = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+            if (len > table->max_len) table->max_len = len;
+        }
+
+        if (j == count) return;
+    }
+}
+
+// Highlight `len` bytes of `text` (which doesn't need to be NUL-terminated)
+// starting in the lexer state `state`, `hl` receives one class per byte.
+// Returns the lexer state at the end of the text.
+//
+// A separator highlighted as normal text leaves the lexer in a clean state,
+// the same whatever came before it. When `hl` still holds the highlight the
+// text had before an edit ending before `sync_from`, the scan stops at the
+// first clean point from there on that was clean in the old highlight too:
+// the rest of `hl` is right already. `synced` then receives that point.
+int editor_syntax_scan_sync(const char* text, int64_t len, int state, unsigned char* hl, int64_t sync_from, int64_t* synced) {
+    if (editor_state.syntax == NULL) {
+        memset(hl, HL_NORMAL, len);
+        return HL_STATE_NORMAL;
+    }
+
+    Keyword_Table* keyword_table = &editor_state.syntax->keyword_table;
+
+    char* scs = editor_state.syntax->singleline_comment_start;
+    char* mcs = editor_state.syntax->multiline_comment_start;
+    char* mce = editor_state.syntax->multiline_comment_end;
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int prev_sep   = 1;
+    int in_string  = 0;
+    int in_comment = (state == HL_STATE_COMMENT);
+
+    int64_t clean_at = -1;
+    int64_t i = 0;
+    while(i < len) {
+        if (i == clean_at && i >= sync_from) {
+            *synced = i;
+            return state;
+        }
+
+        char c = text[i];
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+
+        if(scs_len && !in_string && !in_comment) {
+            if (i + scs_len <= len && !memcmp(&text[i], scs, scs_len)) {
+                memset(&hl[i], HL_COMMENT, len - i);
+                break;
+            }
+        }
+
+        if(mcs_len && mce_len && !in_string) {
+            if(in_comment) {
+                hl[i] = HL_MLCOMMENT;
+                if (i + mce_len <= len && !memcmp(&text[i], mce, mce_len)) {
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
+                    i          += mce_len;
+                    in_comment  = 0;
+                    prev_sep    = 1;
+                    continue;
+                } else {
+                    i += 1;
+                    continue;
+                }
+            } else if(i + mcs_len <= len && !memcmp(&text[i], mcs, mcs_len)) {
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i          += mcs_len;
+                in_comment  = 1;
+                continue;
+            }
+        }
+
+        if (editor_state.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if (in_string) {
+                hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < len) {
+                    hl[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+                if(c == in_string) in_string = 0;
+                i += 1;
+                prev_sep = 1;
+                continue;
+            } else {
+                if (c == '"' || c == '\'') {
+                    in_string = c;
+                    hl[i] = HL_STRING;
+                    i += 1;
+                    continue;
+                }
+            }
+        }
+
+        if (editor_state.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
+                hl[i] = HL_NUMBER;
+                i += 1;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        if(prev_sep) {
+            // A keyword has to span the whole word up to the next separator.
+            int k_len = 0;
+            while (k_len <= keyword_table->max_len && i + k_len < len && !is_separator(text[i + k_len])) {
+                k_len += 1;
+            }
+
+            int keyword_hl = k_len ? keyword_lookup(keyword_table, &text[i], k_len) : HL_NORMAL;
+            if (keyword_hl != HL_NORMAL) {
+                memset(&hl[i], keyword_hl, k_len);
+                i += k_len;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        prev_sep = is_separator(c);
+        if (prev_sep && i + 1 >= sync_from && hl[i] == HL_NORMAL) clean_at = i + 1;
+        hl[i] = HL_NORMAL;
+        i += 1;
+    }
+
+    if (synced) *synced = len;
+    return in_comment ? HL_STATE_COMMENT : HL_STATE_NORMAL;
+}
+
+int editor_syntax_scan(const char* text, int64_t len, int state, unsigned char* hl) {
+    return editor_syntax_scan_sync(text, len, state, hl, INT64_MAX, NULL);
+}
+
+// Lexer state at the end of a row starting in `state`, its highlight is
+// thrown away. `cache` may be NULL.
+int editor_row_exit_state(Editor_Row* row, Row_Cache* cache, int state) {
+    static unsigned char* scratch     = NULL;
+    static int64_t        scratch_cap = 0;
+
+    if (editor_state.syntax == NULL) return HL_STATE_NORMAL;
+
+    bool rendered = cache && cache->render;
+    char* text    = rendered ? cache->render : row->chars;
+    int64_t len   = rendered ? cache->render_size : row->size;
+    if (len > scratch_cap) {
+        scratch_cap = len * 2;
+        scratch     = realloc(scratch, scratch_cap);
+        if (scratch == NULL) die("Error while highlighting a row");
+    }
+
+    return editor_syntax_scan(text, len, state, scratch);
+}
+
+// Queue the row `at` for having its entry state recomputed, the row before it
+// having changed. Rows past `hl_synced` have no state yet and are left alone.
+void editor_syntax_invalidate(int64_t at) {
+    if (at >= editor_state.hl_synced) return;
+
+    if (editor_state.hl_pending_count == EDITOR_HL_PENDING_MAX) {
+        // Out of room: forget the states from the last queued row on, they
+        // will be synced again when something needs them.
+        editor_state.hl_pending_count -= 1;
+        editor_state.hl_synced = editor_state.hl_pending[editor_state.hl_pending_count];
+        if (at >= editor_state.hl_synced) return;
+    }
+
+    int j = 0;
+    while (j < editor_state.hl_pending_count && editor_state.hl_pending[j] < at) j += 1;
+    if (j < editor_state.hl_pending_count && editor_state.hl_pending[j] == at) return;
+
+    memmove(&editor_state.hl_pending[j + 1], &editor_state.hl_pending[j], sizeof(int64_t) * (editor_state.hl_pending_count - j));
+    editor_state.hl_pending[j]     = at;
+    editor_state.hl_pending_count += 1;
+}
+
+// Keep the queued rows pointing at the same rows after one was inserted
+// (`delta` of 1) or deleted (`delta` of -1) at `at`.
+void editor_syntax_shift(int64_t at, int delta) {
+    int count = 0;
+    for (int j = 0; j < editor_state.hl_pending_count; j += 1) {
+        int64_t pending = editor_state.hl_pending[j];
+        if (pending > at) pending += delta;
+        if (count > 0 && editor_state.hl_pending[count - 1] == pending) continue;
+        editor_state.hl_pending[count] = pending;
+        count += 1;
+    }
+    editor_state.hl_pending_count = count;
+}
+
+// Work on the first queued row: recompute entry states down the file until
+// one comes out unchanged, passing through any other queued row on the way.
+// Gives up after `budget` rows or past the row `until`, leaving the rest
+// queued. Returns the number of rows processed.
+int64_t editor_syntax_step(int64_t until, int64_t budget) {
+    int64_t at = editor_state.hl_pending[0];
+
+    Row_Iter it = row_iter_at(at > 0 ? at - 1 : 0);
+    Editor_Row* prev = (at > 0) ? row_iter_next(&it) : NULL;
+    int state = prev ? editor_row_exit_state(prev, row_iter_cache(&it), row_iter_hl_state(&it)) : HL_STATE_NORMAL;
+
+    int64_t done = 0;
+    while (at < editor_state.hl_synced) {
+        if (at > until || done == budget) {
+            editor_state.hl_pending[0] = at;
+            return done;
+        }
+
+        Editor_Row* row = row_iter_next(&it);
+        done += 1;
+        if (row_iter_hl_state(&it) == state) break;
+
+        row_iter_set_hl_state(&it, state);
+        editor_row_drop_hl(row_iter_cache(&it));
+        state = editor_row_exit_state(row, row_iter_cache(&it), state);
+
+        at += 1;
+        if (editor_state.hl_pending_count > 1 && editor_state.hl_pending[1] == at) {
+            memmove(&editor_state.hl_pending[1], &editor_state.hl_pending[2], sizeof(int64_t) * (editor_state.hl_pending_count - 2));
+            editor_state.hl_pending_count -= 1;
+        }
+    }
+
+    memmove(&editor_state.hl_pending[0], &editor_state.hl_pending[1], sizeof(int64_t) * (editor_state.hl_pending_count - 1));
+    editor_state.hl_pending_count -= 1;
+    return done;
+}
+
+// Make sure the entry state of every row up to `at` is right. Queued rows
+// before it are worked off and states past `hl_synced` are computed, which
+// only happens as far down the file as something needed them.
+void editor_syntax_sync(int64_t at) {
+    // the pager keeps lexer states per block, see `pager_block_sync`.
+    if (pager.enabled) return;
+
+    if (at >= editor_state.rows_count) at = editor_state.rows_count - 1;
+
+    while (editor_state.hl_pending_count > 0 && editor_state.hl_pending[0] <= at) {
+        editor_syntax_step(at, INT64_MAX);
+    }
+
+    if (at < editor_state.hl_synced) return;
+
+    // Without a syntax every row starts in the normal state.
+    if (editor_state.syntax == NULL) {
+        editor_state.hl_synced = editor_state.rows_count;
+        return;
+    }
+
+    // Rows past `hl_synced` may still hold a highlight from before their
+    // state was forgotten, it is kept if the state comes out the same.
+    if (editor_state.hl_synced == 0) {
+        Row_Iter first = row_iter_at(0);
+        row_iter_next(&first);
+        if (row_iter_hl_state(&first) != HL_STATE_NORMAL) {
+            row_iter_set_hl_state(&first, HL_STATE_NORMAL);
+            editor_row_drop_hl(row_iter_cache(&first));
+        }
+        editor_state.hl_synced = 1;
+        if (at == 0) return;
+    }
+
+    Row_Iter it = row_iter_at(editor_state.hl_synced - 1);
+    Editor_Row* prev = row_iter_next(&it);
+    int state = editor_row_exit_state(prev, row_iter_cache(&it), row_iter_hl_state(&it));
+    while (editor_state.hl_synced <= at) {
+        Editor_Row* row = row_iter_next(&it);
+        if (row_iter_hl_state(&it) != state) {
+            row_iter_set_hl_state(&it, state);
+            editor_row_drop_hl(row_iter_cache(&it));
+        }
+
+        editor_state.hl_synced += 1;
+        if (editor_state.hl_synced <= at) state = editor_row_exit_state(row, row_iter_cache(&it), state);
+    }
+}
+
+// Drop every cached highlight so rows get highlighted again with the current
+// syntax as they are displayed.
+void editor_syntax_reset(void) {
+    Row_Iter it = row_iter_at(0);
+    while (row_iter_next(&it) != NULL) {
+        editor_row_drop_hl(row_iter_cache(&it));
+        row_iter_set_hl_state(&it, HL_STATE_NORMAL);
+    }
+
+    editor_state.hl_synced        = 0;
+    editor_state.hl_pending_count = 0;
+}
+
+void editor_update_syntax(Row_Cache* cache, int hl_state) {
+    int64_t prof_start = prof_begin();
+    if (cache->hl == NULL) {
+        cache->hl = row_store_alloc(editor_row_hl_size(cache));
+        row_store.cache_bytes += editor_row_hl_size(cache);
+    }
+    prof_count(PROF_ALLOCS, 1);
+    editor_syntax_scan(cache->render, cache->render_size, hl_state, cache->hl);
+    prof_end(PROF_SYNTAX, prof_start);
+}
+
+int editor_syntax_to_color(int hl) {
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36;
+        case HL_KEYWORD1:  return 33;
+        case HL_KEYWORD2:  return 32;
+        case HL_STRING:    return 35;
+        case HL_NUMBER:    return 31;
+        case HL_MATCH:     return 34;
+        default:           return 37;
+    }
+}
+
+void editor_select_syntax_highlight(void) {
+    editor_state.syntax = NULL;
+    if (editor_state.filename == NULL) return;
+
+    char* ext = strrchr(editor_state.filename, '.');
+
+    for(unsigned int j = 0; j < HLDB_COUNT; j += 1) {
+        Editor_Syntax* stx = &HLDB[j];
+
+        unsigned int i = 0;
+        while (stx->file_match[i]) {
+            int is_ext = (stx->file_match[i][0] == '.');
+            if ( (is_ext && ext && !strcmp(ext, stx->file_match[i])) || 
+                 (!is_ext && strstr(editor_state.filename, stx->file_match[i])) ) {
+                editor_state.syntax = stx;
+                editor_syntax_compile(stx);
+                editor_syntax_reset();
+                return;
+            }
+
+            i += 1;
+        }
+    }
+
+    editor_syntax_reset();
+}
+
+/*** row operation ***/
+
+// Render offset reached from `render_x`, the one of char `from`, at char `to`.
+int64_t editor_row_render_x_between(Editor_Row* row, int64_t from, int64_t to, int64_t render_x) {
+    for (int64_t j = from; j < to; j += 1) {
+        if (row->chars[j] == '\t') {
+            render_x += (EDITOR_TAB_STOP - 1) - (render_x % EDITOR_TAB_STOP);
+        }
+        render_x += 1;
+    }
+
+    return render_x;
+}
+
+// Render offset of char `k * EDITOR_COL_STRIDE`, extending the row's column
+// index up to it. Edits only drop the checkpoints past them, so mapping the
+// cursor near the end of a huge line costs a stride, not the whole line.
+int64_t editor_row_col_checkpoint(Editor_Row* row, Row_Cache* cache, int64_t k) {
+    if (k == 0) return 0;
+
+    if (k >= cache->cols_count) {
+        if (k >= cache->cols_cap) {
+            cache->cols            = row_store_realloc(cache->cols, sizeof(int64_t) * cache->cols_cap, sizeof(int64_t) * (k + 1));
+            row_store.cache_bytes += sizeof(int64_t) * (k + 1 - cache->cols_cap);
+            cache->cols_cap        = k + 1;
+        }
+        if (cache->cols_count == 0) {
+            cache->cols[0]    = 0;
+            cache->cols_count = 1;
+        }
+        for (int64_t j = cache->cols_count; j <= k; j += 1) {
+            cache->cols[j] = editor_row_render_x_between(row, (j - 1) * EDITOR_COL_STRIDE, j * EDITOR_COL_STRIDE, cache->cols[j - 1]);
+        }
+        cache->cols_count = k + 1;
+    }
+
+    return cache->cols[k];
+}
+
+// Drop the checkpoints an edit at char `at` moved.
+void editor_row_cols_invalidate(Row_Cache* cache, int64_t at) {
+    int64_t keep = at / EDITOR_COL_STRIDE + 1;
+    if (cache && cache->cols_count > keep) cache->cols_count = keep;
+}
+
+int64_t editor_row_cursor_x_to_render_x(Editor_Row* row, Row_Cache* cache, int64_t cursor_x) {
+    int64_t k = cursor_x / EDITOR_COL_STRIDE;
+    return editor_row_render_x_between(row, k * EDITOR_COL_STRIDE, cursor_x, editor_row_col_checkpoint(row, cache, k));
+}
+
+int64_t editor_row_render_x_to_cursor_x(Editor_Row* row, Row_Cache* cache, int64_t render_x) {
+    // Binary search the last checkpoint at or before `render_x`.
+    int64_t lo = 0;
+    int64_t hi = row->size / EDITOR_COL_STRIDE;
+    editor_row_col_checkpoint(row, cache, hi);
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo + 1) / 2;
+        if (cache->cols[mid] <= render_x) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    int64_t curr_render_x = editor_row_col_checkpoint(row, cache, lo);
+    int64_t cursor_x;
+    for (cursor_x = lo * EDITOR_COL_STRIDE; cursor_x < row->size; cursor_x += 1) {
+        if (row->chars[cursor_x] == '\t') {
+            curr_render_x += (EDITOR_TAB_STOP - 1) - (curr_render_x % EDITOR_TAB_STOP);
+        }
+        curr_render_x += 1;
+
+        if (curr_render_x > render_x) return cursor_x;
+    }
+
+    return cursor_x;
+}
+
+bool editor_row_is_mapped(Editor_Row* row) {
+    return editor_state.map != NULL && row->chars >= editor_state.map && row->chars < editor_state.map + editor_state.map_size;
+}
+
+// Give a row still viewing the mapped file a private copy of its chars, this
+// must be done before modifying them.
+void editor_row_detach(Editor_Row* row) {
+    if (!editor_row_is_mapped(row)) return;
+
+    char* chars = row_store_alloc(row->size + 1);
+    prof_count(PROF_ALLOCS, 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    row->chars = chars;
+}
+
+void editor_update_render(Editor_Row* row, Row_Cache* cache) {
+    int64_t tabs = 0;
+    for(int64_t j = 0; j < row->size; j += 1) {
+        if (row->chars[j] == '\t') tabs += 1;
+    }
+
+    // the highlight goes with the render it was made for.
+    editor_row_drop_hl(cache);
+    if (cache->render) {
+        row_store_free(cache->render, cache->render_size + 1);
+        row_store.cache_bytes -= cache->render_size + 1;
+    }
+    int64_t render_cap = row->size + tabs * (EDITOR_TAB_STOP - 1) + 1;
+    cache->render = row_store_alloc(render_cap);
+    prof_count(PROF_ALLOCS, 1);
+
+    int64_t idx = 0;
+    for (int64_t j = 0; j < row->size; j += 1) {
+        if (row->chars[j] == '\t') {
+            cache->render[idx] = ' ';
+            idx += 1;
+            while (idx % EDITOR_TAB_STOP != 0) {
+                cache->render[idx] = ' ';
+                idx += 1;
+            }
+        } else {
+            cache->render[idx] = row->chars[j];
+            idx += 1;
+        }
+    }
+
+    cache->render[idx] = '\0';
+    cache->render_size = idx;
+    // tabs short of a full tab stop left some of it unused.
+    cache->render = row_store_realloc(cache->render, render_cap, cache->render_size + 1);
+    row_store.cache_bytes += cache->render_size + 1;
+}
+
+// Rows are rendered and highlighted on first display, `render` and `hl` being
+// NULL until then. `cache` receives the cache of the row.
+Editor_Row* editor_row_rendered(int64_t at, Row_Cache** cache) {
+    if (pager.enabled) return pager_row_rendered(at, cache);
+
+    int64_t prof_start = prof_begin();
+    editor_syntax_sync(at);
+    prof_end(PROF_SYNTAX, prof_start);
+
+    int leaf_at;
+    Row_Node* leaf  = row_tree_find_leaf(at, &leaf_at);
+    Editor_Row* row = &leaf->rows[leaf_at];
+    *cache = row_leaf_cache(leaf, leaf_at);
+    if ((*cache)->render == NULL) editor_update_render(row, *cache);
+    if ((*cache)->hl == NULL) editor_update_syntax(*cache, row_leaf_hl_state(leaf, leaf_at));
+    return row;
+}
+
+// The row `at` changed: a render it had is made again, the rest waiting for
+// the row to be displayed.
+void editor_update_row(int64_t at) {
+    Row_Cache* cache = editor_row_cache_peek(at);
+    if (cache && cache->render) editor_update_render(editor_row_at(at), cache);
+
+    editor_syntax_invalidate(at + 1);
+}
+
+// Patch a row `len` chars were just inserted in at `at` (or deleted from,
+// for a negative `len`) instead of rendering and highlighting it again.
+// `old_render_x` is the render offset the first char past the edit had
+// before it. Past the first tab after the edit render columns are back on a
+// tab stop, so only the chars up to it are rendered again and the rest of
+// the render is moved. Highlighting then resumes from the last clean point
+// before the edit, stopping as soon as it falls back in step with the old
+// highlight. A single keystroke thus costs about the same on a huge line as
+// on a short one.
+void editor_update_row_edit(int64_t row_at, Editor_Row* row, Row_Cache* cache, int64_t at, int64_t len, int64_t old_render_x) {
+    if (cache == NULL || cache->render == NULL) {
+        editor_syntax_invalidate(row_at + 1);
+        return;
+    }
+
+    int64_t edit_end = (len > 0) ? at + len : at;
+    char* tab = memchr(&row->chars[edit_end], '\t', row->size - edit_end);
+    int64_t redo_end = tab ? tab - row->chars + 1 : edit_end;
+
+    int64_t render_at  = editor_row_cursor_x_to_render_x(row, cache, at);
+    int64_t new_end    = editor_row_render_x_between(row, at, redo_end, render_at);
+    int64_t old_end    = editor_row_render_x_between(row, edit_end, redo_end, old_render_x);
+    int64_t old_size   = cache->render_size;
+    int64_t tail       = old_size - old_end;
+    int64_t new_size   = new_end + tail;
+
+    // Grown before moving the tail right, shrunk after moving it left.
+    if (new_end > old_end) {
+        cache->render = row_store_realloc(cache->render, old_size + 1, new_size + 1);
+        prof_count(PROF_ALLOCS, 1);
+    }
+    memmove(&cache->render[new_end], &cache->render[old_end], tail + 1);
+    if (new_end < old_end) cache->render = row_store_realloc(cache->render, old_size + 1, new_size + 1);
+    int64_t idx = render_at;
+    for (int64_t j = at; j < redo_end; j += 1) {
+        if (row->chars[j] == '\t') {
+            cache->render[idx] = ' ';
+            idx += 1;
+            while (idx % EDITOR_TAB_STOP != 0) {
+                cache->render[idx] = ' ';
+                idx += 1;
+            }
+        } else {
+            cache->render[idx] = row->chars[j];
+            idx += 1;
+        }
+    }
+    cache->render_size     = new_size;
+    row_store.cache_bytes += new_size - old_size;
+
+    // Without hl the end state of the row isn't known here: the next row is
+    // checked again.
+    if (cache->hl == NULL) {
+        editor_syntax_invalidate(row_at + 1);
+        return;
+    }
+
+    size_t old_hl_size = old_size ? old_size : 1;
+    if (new_end > old_end) {
+        cache->hl = row_store_realloc(cache->hl, old_hl_size, editor_row_hl_size(cache));
+        prof_count(PROF_ALLOCS, 1);
+    }
+    memmove(&cache->hl[new_end], &cache->hl[old_end], tail);
+    if (new_end < old_end) cache->hl = row_store_realloc(cache->hl, old_hl_size, editor_row_hl_size(cache));
+    row_store.cache_bytes += editor_row_hl_size(cache) - old_hl_size;
+
+    // A clean point far enough before the edit for no token crossing it to
+    // reach the edit.
+    int token_len = 0;
+    if (editor_state.syntax) {
+        char* tokens[] = {
+            editor_state.syntax->singleline_comment_start,
+            editor_state.syntax->multiline_comment_start,
+            editor_state.syntax->multiline_comment_end,
+        };
+        for (int j = 0; j < 3; j += 1) {
+            if (tokens[j] && (int) strlen(tokens[j]) > token_len) token_len = strlen(tokens[j]);
+        }
+    }
+
+    int64_t start = render_at - token_len;
+    if (start < 0) start = 0;
+    while (start > 0 && !(cache->hl[start - 1] == HL_NORMAL && is_separator(cache->render[start - 1]))) {
+        start -= 1;
+    }
+
+    int64_t synced;
+    int state = editor_syntax_scan_sync(
+        &cache->render[start],
+        cache->render_size - start,
+        start == 0 ? editor_row_hl_state(row_at) : HL_STATE_NORMAL,
+        &cache->hl[start],
+        new_end + 1 - start,
+        &synced
+    );
+
+    // Caught up with the old highlight, the state at the end of the row
+    // didn't change.
+    if (start + synced < cache->render_size) return;
+
+    if (row_at + 1 < editor_state.rows_count && editor_row_hl_state(row_at + 1) != state) {
+        editor_syntax_invalidate(row_at + 1);
+    }
+}
+
+
+void editor_insert_row(int64_t at, char* line, size_t line_len) {
+    if (at < 0 || at > editor_state.rows_count) return;
+
+    // A row inserted among the synced ones starts in the state of the row it
+    // pushes down.
+    int hl_state = HL_STATE_NORMAL;
+    if (at < editor_state.hl_synced) {
+        hl_state = editor_row_hl_state(at);
+        editor_state.hl_synced += 1;
+        editor_syntax_shift(at, 1);
+    }
+
+    undo_record(UNDO_INSERT_ROW, at, 0, line, line_len);
+
+    Editor_Row* row = row_tree_insert(at, hl_state);
+
+    row->size  = line_len;
+    row->chars = row_store_alloc(line_len + 1);
+    prof_count(PROF_ALLOCS, 1);
+    memcpy(row->chars, line, line_len);
+    row->chars[line_len] = '\0';
+    editor_update_row(at);
+
+    editor_state.chars_total += line_len;
+    editor_state.dirty       += 1;
+}
+
+void editor_free_row(int64_t at) {
+    Editor_Row* row = editor_row_at(at);
+    if (!editor_row_is_mapped(row)) row_store_free(row->chars, row->size + 1);
+    editor_row_cache_free(at);
+}
+
+void editor_del_row(int64_t at) {
+    if (at < 0 || at >= editor_state.rows_count) return;
+    Editor_Row* row = editor_row_at(at);
+    undo_record(UNDO_DELETE_ROW, at, 0, row->chars, row->size);
+    editor_state.chars_total -= row->size;
+    editor_free_row(at);
+    row_tree_delete(at);
+    if (at < editor_state.hl_synced) {
+        editor_state.hl_synced -= 1;
+        editor_syntax_shift(at, -1);
+        editor_syntax_invalidate(at);
+    }
+    editor_state.dirty += 1;
+}
+
+void editor_row_insert_string(int64_t row_at, int64_t at, const char* s, int64_t len) {
+    Editor_Row* row = editor_row_at(row_at);
+    editor_row_detach(row);
+    if(at < 0 || at > row->size) {
+        at = row->size;
+    }
+
+    undo_record(UNDO_INSERT_TEXT, row_at, at, s, len);
+
+    Row_Cache* cache = editor_row_cache_peek(row_at);
+    int64_t old_render_x = (cache && cache->render) ? editor_row_cursor_x_to_render_x(row, cache, at) : 0;
+    row->chars = row_store_realloc(row->chars, row->size + 1, row->size + len + 1);
+    prof_count(PROF_ALLOCS, 1);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    editor_row_cols_invalidate(cache, at);
+    editor_update_row_edit(row_at, row, cache, at, len, old_render_x);
+    editor_state.chars_total += len;
+    editor_state.dirty       += 1;
+}
+
+void editor_row_insert_char(int64_t row_at, int64_t at, int c) {
+    char ch = c;
+    editor_row_insert_string(row_at, at, &ch, 1);
+}
+
+void editor_row_append_string(int64_t row_at, char* s, size_t len) {
+    editor_row_insert_string(row_at, editor_row_at(row_at)->size, s, len);
+}
+
+void editor_row_del_string(int64_t row_at, int64_t at, int64_t len) {
+    Editor_Row* row = editor_row_at(row_at);
+    editor_row_detach(row);
+    if(at < 0 || len <= 0 || at + len > row->size) return;
+
+    undo_record(UNDO_DELETE_TEXT, row_at, at, &row->chars[at], len);
+
+    Row_Cache* cache = editor_row_cache_peek(row_at);
+    int64_t old_render_x = (cache && cache->render) ? editor_row_cursor_x_to_render_x(row, cache, at + len) : 0;
+
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->chars = row_store_realloc(row->chars, row->size + 1, row->size - len + 1);
+    row->size -= len;
+    editor_row_cols_invalidate(cache, at);
+    editor_update_row_edit(row_at, row, cache, at, -len, old_render_x);
+    editor_state.chars_total -= len;
+    editor_state.dirty       += 1;
+}
+
+void editor_row_del_char(int64_t row_at, int64_t at) {
+    editor_row_del_string(row_at, at, 1);
+}
+
+/*** editor operations ***/
+
+// The pager can't edit the file.
+bool editor_read_only(void) {
+    if (pager.enabled) editor_set_status_msg("Read-only pager");
+    return pager.enabled;
+}
+
+void editor_insert_char(int c) {
+    if (editor_read_only()) return;
+    if(editor_state.cursor_y == editor_state.rows_count) {
+        editor_insert_row(editor_state.rows_count, "", 0);
+    }
+
+    editor_row_insert_char(editor_state.cursor_y, editor_state.cursor_x, c);
+    editor_state.cursor_x += 1;
+}
+
+// Insert `text` at the cursor as a single edit, line breaks splitting rows:
+// each row it touches is rendered once instead of once per character.
+void editor_insert_text(char* text, int64_t len) {
+    if (editor_read_only()) return;
+    if(editor_state.cursor_y == editor_state.rows_count) {
+        editor_insert_row(editor_state.rows_count, "", 0);
+    }
+
+    // What follows the cursor ends up after the inserted text.
+    Editor_Row* row  = editor_row_at(editor_state.cursor_y);
+    int64_t tail_len = row->size - editor_state.cursor_x;
+    char* last       = malloc(len + tail_len + 1);
+    if (last == NULL) die("Error while inserting text");
+    memcpy(&last[len], &row->chars[editor_state.cursor_x], tail_len);
+    editor_row_del_string(editor_state.cursor_y, editor_state.cursor_x, tail_len);
+
+    bool first    = true;
+    int64_t start = 0;
+    for (int64_t i = 0; i <= len; i += 1) {
+        if (i < len && text[i] != '\r' && text[i] != '\n') continue;
+
+        char* line       = &text[start];
+        int64_t line_len = i - start;
+        int64_t cursor_x = line_len;
+        if (i == len) {
+            memcpy(&last[len - line_len], line, line_len);
+            line      = &last[len - line_len];
+            line_len += tail_len;
+        }
+
+        if (first) {
+            cursor_x += editor_state.cursor_x;
+            editor_row_append_string(editor_state.cursor_y, line, line_len);
+        } else {
+            editor_state.cursor_y += 1;
+            editor_insert_row(editor_state.cursor_y, line, line_len);
+        }
+        editor_state.cursor_x = cursor_x;
+        first = false;
+
+        if (i + 1 < len && text[i] == '\r' && text[i + 1] == '\n') i += 1;
+        start = i + 1;
+    }
+
+    free(last);
+}
+
+void editor_insert_new_line(void) {
+    if (editor_read_only()) return;
+    if (editor_state.cursor_x == 0) {
+        editor_insert_row(editor_state.cursor_y, "", 0);
+    } else {
+        Editor_Row* row = editor_row_at(editor_state.cursor_y);
+        editor_insert_row(editor_state.cursor_y + 1, &row->chars[editor_state.cursor_x], row->size - editor_state.cursor_x);
+        row = editor_row_at(editor_state.cursor_y);
+        editor_row_del_string(editor_state.cursor_y, editor_state.cursor_x, row->size - editor_state.cursor_x);
+    }
+
+    editor_state.cursor_y += 1;
+    editor_state.cursor_x  = 0;
+}
+
+void editor_del_char(void) {
+    if (editor_read_only()) return;
+    if (editor_state.cursor_y == editor_state.rows_count) return;
+    if (editor_state.cursor_x == 0 && editor_state.cursor_y == 0) return;
+
+
+    Editor_Row* row = editor_row_at(editor_state.cursor_y);
+    if (editor_state.cursor_x > 0) {
+        editor_row_del_char(editor_state.cursor_y, editor_state.cursor_x - 1);
+        editor_state.cursor_x -= 1;
+    } else {
+        editor_state.cursor_x = editor_row_at(editor_state.cursor_y - 1)->size;
+        editor_row_append_string(editor_state.cursor_y - 1, row->chars, row->size);
+        editor_del_row(editor_state.cursor_y);
+        editor_state.cursor_y -= 1;
+    }
+}
+
+/*** undo ***/
+
+// Edits are journaled as the row operations making them up, each with the
+// bytes it inserted or deleted: undoing costs the size of the edit, not of
+// the file. Every undo step opens with a mark holding the cursor before and
+// after it, and keystrokes typing or deleting contiguous text extend the step
+// before them. Records sit back to back in one arena which, past
+// EDITOR_UNDO_MAX bytes, loses its oldest steps.
+#define EDITOR_UNDO_MAX (64 << 20)
+
+typedef struct Undo_Record {
+    // For a mark, the cursor before the step. Its position after the step is
+    // the data.
+    int64_t       row;
+    int64_t       col;
+    // Bytes of data following the record.
+    int64_t       len;
+    // Size of the record before this one, 0 for the first.
+    int64_t       prev_size;
+    unsigned char type;
+} Undo_Record;
+
+typedef struct Undo_Journal {
+    char*   b;
+    int64_t len;
+    int64_t cap;
+    // Records before `at` are done, the ones after it can be redone.
+    int64_t at;
+    // Last done record, -1 when there is none.
+    int64_t last;
+    // Mark of the step keystrokes may still extend, -1 once it is sealed.
+    int64_t step;
+    // Set while undoing or loading a file, row operations aren't recorded.
+    bool    paused;
+    // Set when the step of the current key outgrew the journal.
+    bool    dropped;
+    // Whether the current key recorded anything yet, and the cursor before it.
+    bool    key_recorded;
+    int64_t key_cursor_x, key_cursor_y;
+} Undo_Journal;
+
+Undo_Journal undo = { .last = -1, .step = -1 };
+
+Undo_Record* undo_record_at(int64_t offset) {
+    return (Undo_Record*) &undo.b[offset];
+}
+
+int64_t undo_record_size(int64_t len) {
+    return sizeof(Undo_Record) + ((len + 7) & ~7);
+}
+
+void undo_reserve(int64_t len) {
+    if (len <= undo.cap) return;
+
+    int64_t cap = undo.cap ? undo.cap : 4096;
+    while (cap < len) cap *= 2;
+
+    undo.b = realloc(undo.b, cap);
+    if (undo.b == NULL) die("Error while growing the undo journal");
+    undo.cap = cap;
+}
+
+void undo_clear(void) {
+    undo.len  = 0;
+    undo.at   = 0;
+    undo.last = -1;
+    undo.step = -1;
+}
+
+// Append a record after the done ones, whatever could be redone is dropped.
+void undo_push(int type, int64_t row, int64_t col, const char* data, int64_t len) {
+    undo.len = undo.at;
+    undo_reserve(undo.len + undo_record_size(len));
+
+    Undo_Record* record = undo_record_at(undo.len);
+    record->row       = row;
+    record->col       = col;
+    record->len       = len;
+    record->prev_size = (undo.last == -1) ? 0 : undo.len - undo.last;
+    record->type      = type;
+    memcpy(record + 1, data, len);
+
+    undo.last  = undo.len;
+    undo.len  += undo_record_size(len);
+    undo.at    = undo.len;
+}
+
+// Extend the last record of the open step with an edit right next to it.
+// Returns false when the edit doesn't continue it.
+bool undo_coalesce(int type, int64_t row, int64_t col, const char* data, int64_t len) {
+    if (undo.step == -1 || undo.last == undo.step) return false;
+
+    Undo_Record* last = undo_record_at(undo.last);
+    if (last->type != type || last->row != row) return false;
+
+    bool append;
+    if (type == UNDO_INSERT_TEXT && col == last->col + last->len) {
+        append = true;
+    } else if (type == UNDO_DELETE_TEXT && col == last->col) {
+        // forward delete.
+        append = true;
+    } else if (type == UNDO_DELETE_TEXT && col + len == last->col) {
+        // backspace.
+        append = false;
+    } else {
+        return false;
+    }
+
+    undo_reserve(undo.last + undo_record_size(last->len + len));
+    last = undo_record_at(undo.last);
+    char* last_data = (char*) (last + 1);
+
+    if (append) {
+        memcpy(&last_data[last->len], data, len);
+    } else {
+        memmove(&last_data[len], last_data, last->len);
+        memcpy(last_data, data, len);
+        last->col = col;
+    }
+    last->len += len;
+    undo.len   = undo.last + undo_record_size(last->len);
+    undo.at    = undo.len;
+    return true;
+}
+
+// Drop the oldest steps once the journal is over EDITOR_UNDO_MAX, down to
+// three quarters of it so that the journal isn't moved on every record. A
+// step too large to fit on its own is dropped whole.
+void undo_trim(void) {
+    if (undo.len <= EDITOR_UNDO_MAX) return;
+
+    int64_t cut = 0;
+    for (int64_t offset = 0; offset < undo.len; offset += undo_record_size(undo_record_at(offset)->len)) {
+        if (offset == 0 || undo_record_at(offset)->type != UNDO_MARK) continue;
+        cut = offset;
+        if (undo.len - cut <= EDITOR_UNDO_MAX / 4 * 3) break;
+    }
+
+    if (undo.len - cut > EDITOR_UNDO_MAX) {
+        undo_clear();
+        undo.dropped = true;
+        editor_set_status_msg("Edit too large to be undone");
+        return;
+    }
+
+    memmove(undo.b, &undo.b[cut], undo.len - cut);
+    undo.len  -= cut;
+    undo.at   -= cut;
+    undo.last -= cut;
+    if (undo.step != -1) undo.step -= cut;
+    undo_record_at(0)->prev_size = 0;
+}
+
+// Called by the row operations for every change they make.
+void undo_record(int type, int64_t row, int64_t col, const char* data, int64_t len) {
+    // undoing is an edit like any other for the swap file.
+    swap_record(type, row, col, data, len);
+    if (undo.paused || undo.dropped) return;
+
+    if (!undo.key_recorded) {
+        undo.key_recorded = true;
+        if (undo_coalesce(type, row, col, data, len)) return;
+
+        int64_t cursor_after[2] = { undo.key_cursor_x, undo.key_cursor_y };
+        undo_push(UNDO_MARK, undo.key_cursor_y, undo.key_cursor_x, (char*) cursor_after, sizeof(cursor_after));
+        undo.step = undo.last;
+    }
+
+    undo_push(type, row, col, data, len);
+    undo_trim();
+}
+
+void undo_key_start(void) {
+    undo.key_recorded = false;
+    undo.dropped      = false;
+    undo.key_cursor_x = editor_state.cursor_x;
+    undo.key_cursor_y = editor_state.cursor_y;
+}
+
+// With `coalesce` the next key may extend the step of this one.
+void undo_key_end(bool coalesce) {
+    if (undo.key_recorded && undo.step != -1) {
+        int64_t* cursor_after = (int64_t*) (undo_record_at(undo.step) + 1);
+        cursor_after[0] = editor_state.cursor_x;
+        cursor_after[1] = editor_state.cursor_y;
+    }
+
+    if (!coalesce) undo.step = -1;
+}
+
+void undo_apply(Undo_Record* record, bool inverse) {
+    char* data = (char*) (record + 1);
+    int type   = record->type;
+    if (inverse) {
+        switch (type) {
+            case UNDO_INSERT_TEXT: type = UNDO_DELETE_TEXT; break;
+            case UNDO_DELETE_TEXT: type = UNDO_INSERT_TEXT; break;
+            case UNDO_INSERT_ROW:  type = UNDO_DELETE_ROW;  break;
+            case UNDO_DELETE_ROW:  type = UNDO_INSERT_ROW;  break;
+        }
+    }
+
+    switch (type) {
+        case UNDO_INSERT_TEXT: editor_row_insert_string(record->row, record->col, data, record->len); break;
+        case UNDO_DELETE_TEXT: editor_row_del_string(record->row, record->col, record->len); break;
+        case UNDO_INSERT_ROW:  editor_insert_row(record->row, data, record->len); break;
+        case UNDO_DELETE_ROW:  editor_del_row(record->row); break;
+    }
+}
+
+void editor_undo(void) {
+    if (undo.last == -1) {
+        editor_set_status_msg("Nothing to undo");
+        return;
+    }
+
+    undo.paused = true;
+    while (true) {
+        Undo_Record* record = undo_record_at(undo.last);
+        undo.at   = undo.last;
+        undo.last = record->prev_size ? undo.last - record->prev_size : -1;
+
+        if (record->type == UNDO_MARK) {
+            editor_state.cursor_x = record->col;
+            editor_state.cursor_y = record->row;
+            break;
+        }
+        undo_apply(record, true);
+    }
+    undo.paused = false;
+    undo.step   = -1;
+}
+
+void editor_redo(void) {
+    if (undo.at == undo.len) {
+        editor_set_status_msg("Nothing to redo");
+        return;
+    }
+
+    undo.paused = true;
+    Undo_Record* mark = undo_record_at(undo.at);
+    do {
+        Undo_Record* record = undo_record_at(undo.at);
+        if (record != mark) undo_apply(record, false);
+        undo.last  = undo.at;
+        undo.at   += undo_record_size(record->len);
+    } while (undo.at < undo.len && undo_record_at(undo.at)->type != UNDO_MARK);
+    undo.paused = false;
+
+    int64_t* cursor_after = (int64_t*) (mark + 1);
+    editor_state.cursor_x = cursor_after[0];
+    editor_state.cursor_y = cursor_after[1];
+}
+
+/*** line index ***/
+
+Line_Index* line_index_new(void) {
+    Line_Index* index = calloc(1, sizeof(Line_Index));
+    if (index == NULL) die("Error while indexing the file");
+
+    index->fd = -1;
+    pthread_mutex_init(&index->lock, NULL);
+    pthread_cond_init(&index->progress, NULL);
+    return index;
+}
+
+// Stop the thread, if any, and free the index.
+void line_index_free(Line_Index* index) {
+    if (index->running) {
+        atomic_store(&index->cancel, true);
+        pthread_join(index->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&index->lock);
+    pthread_cond_destroy(&index->progress);
+    free(index->offsets);
+    free(index);
+}
+
+// Publish what was found since the last report and wake up whoever waits
+// for it.
+void line_index_report(Line_Index* index, int64_t scanned, int64_t new_lines, int64_t line_start) {
+    pthread_mutex_lock(&index->lock);
+    atomic_store(&index->scanned, scanned);
+    atomic_store(&index->new_lines, new_lines);
+    atomic_store(&index->line_start, line_start);
+    pthread_cond_broadcast(&index->progress);
+    pthread_mutex_unlock(&index->lock);
+}
+
+// Read through the file a chunk at a time, nothing of it stays in memory but
+// the offsets. The main thread only reads what was reported. The index is
+// its own rather than the current one, which changes with the buffer.
+void* line_index_run(void* arg) {
+    Line_Index* index = arg;
+    long page = sysconf(_SC_PAGESIZE);
+    int64_t file_size  = index->file_size;
+    int64_t scanned    = 0;
+    int64_t new_lines  = 0;
+    int64_t line_start = 0;
+    int64_t offsets_count = 1;
+
+    while (scanned < file_size && !atomic_load(&index->cancel)) {
+        int64_t start = scanned / page * page;
+        int64_t len   = file_size - start;
+        if (len > LINE_INDEX_CHUNK) len = LINE_INDEX_CHUNK;
+
+        char* map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, index->fd, start);
+        if (map == MAP_FAILED) die("Error while indexing the file");
+        madvise(map, len, MADV_SEQUENTIAL);
+
+        char* at  = &map[scanned - start];
+        char* end = &map[len];
+        while (at < end && !atomic_load(&index->cancel)) {
+            char* slice_end = (end - at > LINE_INDEX_SLICE) ? at + LINE_INDEX_SLICE : end;
+            char* new_line;
+            while ((new_line = memchr(at, '\n', slice_end - at)) != NULL) {
+                at          = new_line + 1;
+                line_start  = start + (at - map);
+                new_lines  += 1;
+                if (new_lines % LINE_INDEX_STRIDE == 0) {
+                    index->offsets[offsets_count] = line_start;
+                    offsets_count += 1;
+                    atomic_store(&index->offsets_count, offsets_count);
+                }
+            }
+            at = slice_end;
+            line_index_report(index, start + (at - map), new_lines, line_start);
+        }
+
+        scanned = start + (at - map);
+        if (scanned == file_size) index->partial_last = (end[-1] != '\n');
+        munmap(map, len);
+    }
+
+    close(index->fd);
+    index->fd = -1;
+    pthread_mutex_lock(&index->lock);
+    atomic_store(&index->done, true);
+    pthread_cond_broadcast(&index->progress);
+    pthread_mutex_unlock(&index->lock);
+    editor_wake();
+    return NULL;
+}
+
+// Start indexing the `file_size` bytes of the file open on `fd` in the
+// background, `fd` being closed once it is done.
+void line_index_start(int fd, int64_t file_size) {
+    // a line takes a byte at least.
+    line_index->offsets = calloc(file_size / LINE_INDEX_STRIDE + 2, sizeof(int64_t));
+    if (line_index->offsets == NULL) die("Error while indexing the file");
+    line_index->fd        = fd;
+    line_index->file_size = file_size;
+    atomic_store(&line_index->offsets_count, 1);
+
+    if (pthread_create(&line_index->thread, NULL, line_index_run, line_index) != 0) {
+        die("Error while starting the line index");
+    }
+    line_index->running = true;
+}
+
+// Every line is indexed and, out of the pager, loaded.
+bool line_index_done(void) {
+    return !line_index->running || (atomic_load(&line_index->done) && !line_index->loading);
+}
+
+bool line_index_ready(int64_t lines, int64_t offset) {
+    return atomic_load(&line_index->done)
+        || (atomic_load(&line_index->new_lines) >= lines && atomic_load(&line_index->line_start) > offset);
+}
+
+// Wait until `lines` lines and the end of the line holding the byte at
+// `offset` are indexed, or the whole file is.
+void line_index_wait(int64_t lines, int64_t offset) {
+    if (!line_index->running || line_index_ready(lines, offset)) return;
+
+    int64_t prof_start = prof_begin();
+    pthread_mutex_lock(&line_index->lock);
+    while (!line_index_ready(lines, offset)) {
+        pthread_cond_wait(&line_index->progress, &line_index->lock);
+    }
+    pthread_mutex_unlock(&line_index->lock);
+    prof_end(PROF_LOAD, prof_start);
+}
+
+// Percentage of the file indexed, or loaded out of the pager.
+int line_index_progress(void) {
+    if (line_index->file_size == 0) return 100;
+
+    int64_t at = atomic_load(&line_index->scanned);
+    if (line_index->loading) at = line_index->offsets[line_index->blocks_loaded];
+    return at * 100 / line_index->file_size;
+}
+
+// Turn the lines of the next indexed block into rows viewing the mapping,
+// after the rows loaded so far. Returns false when the end of the block isn't
+// known yet or every block is loaded.
+bool editor_load_block(void) {
+    if (!line_index->loading) return false;
+
+    bool done = atomic_load(&line_index->done);
+    int64_t offsets_count = atomic_load(&line_index->offsets_count);
+    int64_t at = line_index->blocks_loaded;
+    if (at + 1 >= offsets_count && !done) return false;
+
+    int64_t start = line_index->offsets[at];
+    int64_t end   = (at + 1 < offsets_count) ? line_index->offsets[at + 1] : (int64_t) editor_state.map_size;
+
+    char* line      = &editor_state.map[start];
+    char* block_end = &editor_state.map[end];
+    while (line < block_end) {
+        char* new_line = memchr(line, '\n', block_end - line);
+        size_t line_len = (new_line ? new_line : block_end) - line;
+        while (line_len > 0 && line[line_len - 1] == '\r') {
+            line_len -= 1;
+        }
+
+        Editor_Row* row = row_tree_insert(editor_state.rows_count, HL_STATE_NORMAL);
+        row->size  = line_len;
+        row->chars = line;
+        editor_state.chars_total += line_len;
+
+        line = new_line ? new_line + 1 : block_end;
+    }
+
+    line_index->blocks_loaded += 1;
+    if (at + 1 >= offsets_count) line_index->loading = false;
+    return true;
+}
+
+// Make sure the first `rows` rows are there, waiting for the line index only
+// as far as they go.
+void line_index_load(int64_t rows) {
+    if (pager.enabled) {
+        pager_index_until(rows, -1);
+        return;
+    }
+
+    while (line_index->loading && editor_state.rows_count < rows) {
+        line_index_wait((line_index->blocks_loaded + 1) * LINE_INDEX_STRIDE, -1);
+
+        int64_t prof_start = prof_begin();
+        editor_load_block();
+        prof_end(PROF_LOAD, prof_start);
+    }
+}
+
+// How often the screen follows a load to the end of the file.
+#define LINE_INDEX_POLL_MS 50
+
+// Load the file to its end, giving up as soon as a key is pressed with the
+// rows loaded so far kept. The last of them is shown while waiting for the
+// line index.
+void line_index_load_all(void) {
+    struct pollfd stdin_poll = { .fd = STDIN_FILENO, .events = POLLIN };
+
+    while (pager.enabled ? line_index->running && !atomic_load(&line_index->done) : line_index->loading) {
+        if (editor_input_pending()) return;
+
+        int64_t prof_start = prof_begin();
+        bool loaded = !pager.enabled && editor_load_block();
+        prof_end(PROF_LOAD, prof_start);
+        if (loaded) continue;
+
+        // a replay always has its next key ready, it waits for the file instead.
+        if (replay.enabled) {
+            line_index_wait(pager.enabled ? INT64_MAX : (line_index->blocks_loaded + 1) * LINE_INDEX_STRIDE, -1);
+            continue;
+        }
+
+        if (pager.enabled) pager_sync_rows();
+        editor_state.cursor_y = editor_state.rows_count > 0 ? editor_state.rows_count - 1 : 0;
+        editor_state.cursor_x = 0;
+        editor_refresh_screen();
+        poll(&stdin_poll, 1, LINE_INDEX_POLL_MS);
+    }
+
+    if (pager.enabled) pager_sync_rows();
+}
+
+// Called while waiting for a key: load the next block, or show the rows the
+// pager has. Returns true when the screen needs a refresh.
+bool line_index_idle(void) {
+    if (!line_index->running) return false;
+
+    // no row is added while a search reads them.
+    if (find_running()) return false;
+
+    bool changed = false;
+    if (pager.enabled) {
+        int64_t old_rows_count = editor_state.rows_count;
+        pager_sync_rows();
+        changed = (editor_state.rows_count != old_rows_count);
+    } else {
+        int64_t prof_start = prof_begin();
+        changed = editor_load_block();
+        prof_end(PROF_LOAD, prof_start);
+    }
+
+    if (atomic_load(&line_index->done) && !line_index->loading) {
+        pthread_join(line_index->thread, NULL);
+        line_index->running = false;
+        if (pager.enabled) pager_sync_rows();
+        changed = true;
+    }
+
+    return changed;
+}
+
+/*** swap ***/
+
+// Every row operation is also appended to a journal next to the file, the
+// swap file `.<name>.swp`, so that edits survive a crash without the whole
+// file being saved. Records are buffered and go out as one checksummed batch
+// followed by `fdatasync`, EDITOR_SWAP_MS after the first of them or as soon
+// as EDITOR_SWAP_BATCH bytes are waiting. The journal opens with the size and
+// modification time of the file it applies to and starts over on every save.
+// A journal left behind is replayed by `editor_open`, which costs the size of
+// the edits in it rather than the size of the file.
+#define EDITOR_SWAP_MS    1000
+#define EDITOR_SWAP_BATCH (1 << 20)
+#define SWAP_MAGIC        "EDSWAP02"
+// A batch starts with the length of its records and their checksum, see
+// `Swap_Batch_Header`.
+#define SWAP_BATCH_HEADER 16
+
+typedef struct Swap_Batch_Header {
+    int64_t  len;
+    uint32_t checksum;
+    uint32_t padding;
+} Swap_Batch_Header;
+
+typedef struct Swap_Header {
+    char    magic[8];
+    int64_t file_size;
+    int64_t file_mtime_sec;
+    int64_t file_mtime_nsec;
+} Swap_Header;
+
+typedef struct Swap_Journal {
+    // -1 while there is no journal, like for a buffer without a file name.
+    int     fd;
+    char*   path;
+    // Batch being built, its header included.
+    char*   b;
+    int64_t len;
+    int64_t cap;
+    // When the first record of the batch came in.
+    long    batch_at;
+} Swap_Journal;
+
+Swap_Journal swap = { .fd = -1 };
+
+#define SWAP_CHECKSUM_SEED 2166136261u
+
+// Go on with `hash` over `data`, a batch written in parts is checksummed as
+// one.
+uint32_t swap_checksum(uint32_t hash, const char* data, int64_t len) {
+    for (int64_t i = 0; i < len; i += 1) {
+        hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void swap_append(const void* data, int64_t len) {
+    if (swap.len + len > swap.cap) {
+        int64_t cap = swap.cap ? swap.cap : 4096;
+        while (cap < swap.len + len) cap *= 2;
+
+        swap.b = realloc(swap.b, cap);
+        if (swap.b == NULL) die("Error while growing the swap journal");
+        swap.cap = cap;
+    }
+
+    memcpy(&swap.b[swap.len], data, len);
+    swap.len += len;
+}
+
+// Numbers are written 7 bits at a time, most records fitting in a few bytes.
+void swap_append_number(int64_t n) {
+    unsigned char b[10];
+    int len = 0;
+    uint64_t u = n;
+    do {
+        b[len] = (u & 0x7f) | (u >= 0x80 ? 0x80 : 0);
+        u >>= 7;
+        len += 1;
+    } while (u);
+
+    swap_append(b, len);
+}
+
+// Read a number written by `swap_append_number` from `*at`, moving past it.
+// False when the data ends before the number does.
+bool swap_read_number(const char* data, int64_t len, int64_t* at, int64_t* n) {
+    uint64_t u = 0;
+    for (int shift = 0; *at < len && shift < 64; shift += 7) {
+        unsigned char b = data[*at];
+        *at += 1;
+        u |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *n = u;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool swap_write_all(const char* data, int64_t len) {
+    while (len > 0) {
+        ssize_t count = write(swap.fd, data, len);
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += count;
+        len  -= count;
+    }
+
+    return true;
+}
+
+void swap_close(void) {
+    if (swap.fd != -1) close(swap.fd);
+    swap.fd  = -1;
+    swap.len = 0;
+}
+
+// Write the batch and make it durable. A journal that can't be written is
+// given up on, saving still works.
+void swap_flush(void) {
+    if (swap.fd == -1 || swap.len == 0) return;
+
+    Swap_Batch_Header batch_header = {
+        .len      = swap.len - SWAP_BATCH_HEADER,
+        .checksum = swap_checksum(SWAP_CHECKSUM_SEED, &swap.b[SWAP_BATCH_HEADER], swap.len - SWAP_BATCH_HEADER),
+    };
+    memcpy(swap.b, &batch_header, SWAP_BATCH_HEADER);
+
+    if (!swap_write_all(swap.b, swap.len) || fdatasync(swap.fd) == -1) {
+        editor_set_status_msg("Swap file disabled! I/O error: %s", strerror(errno));
+        swap_close();
+        return;
+    }
+    swap.len = 0;
+}
+
+// A record whose text doesn't fit in a batch, like a big paste, goes out as
+// a batch of its own: the text is written from where it is rather than
+// copied into the journal buffer.
+void swap_write_record(const char* text, int64_t text_len) {
+    int64_t head_len = swap.len - SWAP_BATCH_HEADER;
+    uint32_t checksum = swap_checksum(SWAP_CHECKSUM_SEED, &swap.b[SWAP_BATCH_HEADER], head_len);
+    Swap_Batch_Header batch_header = {
+        .len      = head_len + text_len,
+        .checksum = swap_checksum(checksum, text, text_len),
+    };
+    memcpy(swap.b, &batch_header, SWAP_BATCH_HEADER);
+
+    if (!swap_write_all(swap.b, swap.len) || !swap_write_all(text, text_len) || fdatasync(swap.fd) == -1) {
+        editor_set_status_msg("Swap file disabled! I/O error: %s", strerror(errno));
+        swap_close();
+        return;
+    }
+    swap.len = 0;
+}
+
+// Called for every row operation, see `undo_record`.
+void swap_record(int type, int64_t row, int64_t col, const char* data, int64_t len) {
+    if (swap.fd == -1) return;
+
+    bool has_text = type == UNDO_INSERT_TEXT || type == UNDO_INSERT_ROW;
+    bool alone    = has_text && len >= EDITOR_SWAP_BATCH;
+    if (alone) swap_flush();
+    if (swap.fd == -1) return;
+
+    if (swap.len == 0) {
+        // room for the batch header, filled in by `swap_flush`.
+        Swap_Batch_Header placeholder = {0};
+        swap_append(&placeholder, SWAP_BATCH_HEADER);
+        swap.batch_at = editor_now_ms();
+    }
+
+    unsigned char type_byte = type;
+    swap_append(&type_byte, 1);
+    swap_append_number(row);
+    switch (type) {
+        case UNDO_INSERT_TEXT:
+            swap_append_number(col);
+            swap_append_number(len);
+            if (!alone) swap_append(data, len);
+            break;
+        case UNDO_DELETE_TEXT:
+            swap_append_number(col);
+            swap_append_number(len);
+            break;
+        case UNDO_INSERT_ROW:
+            swap_append_number(len);
+            if (!alone) swap_append(data, len);
+            break;
+    }
+
+    if (alone) {
+        swap_write_record(data, len);
+    } else if (swap.len >= EDITOR_SWAP_BATCH) {
+        swap_flush();
+    }
+}
+
+// Time until the batch is due, -1 when there is none.
+int swap_due_in(void) {
+    if (swap.fd == -1 || swap.len == 0) return -1;
+
+    long due_in = swap.batch_at + EDITOR_SWAP_MS - editor_now_ms();
+    return due_in > 0 ? due_in : 0;
+}
+
+// `.<name>.swp` in the directory of the file.
+char* swap_path(const char* filename) {
+    const char* slash = strrchr(filename, '/');
+    int dir_len = slash ? slash - filename + 1 : 0;
+
+    size_t path_size = strlen(filename) + 6;
+    char* path = malloc(path_size);
+    if (path == NULL) die("Error while opening the swap file");
+    snprintf(path, path_size, "%.*s.%s.swp", dir_len, filename, &filename[dir_len]);
+    return path;
+}
+
+bool swap_header_matches(Swap_Header* header, struct stat* st) {
+    return !memcmp(header->magic, SWAP_MAGIC, sizeof(header->magic))
+        && header->file_size       == st->st_size
+        && header->file_mtime_sec  == st->st_mtim.tv_sec
+        && header->file_mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+// Start an empty journal for the file as it is on disk now.
+void swap_start(void) {
+    swap_close();
+
+    struct stat st;
+    if (editor_state.filename == NULL || stat(editor_state.filename, &st) == -1) return;
+
+    free(swap.path);
+    swap.path = swap_path(editor_state.filename);
+    swap.fd   = open(swap.path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (swap.fd == -1) return;
+
+    Swap_Header header = {
+        .file_size       = st.st_size,
+        .file_mtime_sec  = st.st_mtim.tv_sec,
+        .file_mtime_nsec = st.st_mtim.tv_nsec,
+    };
+    memcpy(header.magic, SWAP_MAGIC, sizeof(header.magic));
+    if (!swap_write_all((char*) &header, sizeof(header))) swap_close();
+}
+
+// Apply the records of a batch. Returns false on a record that doesn't fit
+// the rows, the rest of the journal being left alone.
+bool swap_replay_batch(const char* data, int64_t len, int64_t* edits) {
+    int64_t at = 0;
+    while (at < len) {
+        int type = (unsigned char) data[at];
+        at += 1;
+
+        int64_t row, col = 0, text_len = 0;
+        if (!swap_read_number(data, len, &at, &row)) return false;
+        if (type == UNDO_INSERT_TEXT || type == UNDO_DELETE_TEXT) {
+            if (!swap_read_number(data, len, &at, &col)) return false;
+        }
+        if (type != UNDO_DELETE_ROW && !swap_read_number(data, len, &at, &text_len)) return false;
+
+        const char* text = &data[at];
+        if (type == UNDO_INSERT_TEXT || type == UNDO_INSERT_ROW) {
+            if (text_len < 0 || text_len > len - at) return false;
+            at += text_len;
+        }
+
+        bool row_ok = (type == UNDO_INSERT_ROW) ? row <= editor_state.rows_count : row < editor_state.rows_count;
+        if (row < 0 || !row_ok) return false;
+
+        switch (type) {
+            case UNDO_INSERT_TEXT: editor_row_insert_string(row, col, text, text_len); break;
+            case UNDO_DELETE_TEXT: editor_row_del_string(row, col, text_len); break;
+            case UNDO_INSERT_ROW:  editor_insert_row(row, (char*) text, text_len); break;
+            case UNDO_DELETE_ROW:  editor_del_row(row); break;
+            default:               return false;
+        }
+        *edits += 1;
+    }
+
+    return true;
+}
+
+// Replay the journal of the file just loaded when one was left behind, then
+// keep journaling to it. Batches are applied up to the first one that is
+// torn or corrupt, which is cut off along with the rest.
+void swap_open(void) {
+    struct stat st;
+    if (stat(editor_state.filename, &st) == -1) return;
+
+    char* path = swap_path(editor_state.filename);
+    int fd = open(path, O_RDWR);
+    free(path);
+    if (fd == -1) {
+        swap_start();
+        return;
+    }
+
+    struct stat swap_st;
+    Swap_Header header;
+    if (fstat(fd, &swap_st) == -1
+        || read(fd, &header, sizeof(header)) != sizeof(header)
+        || !swap_header_matches(&header, &st)) {
+        close(fd);
+        editor_set_status_msg("Swap file doesn't match the file, ignored");
+        swap_start();
+        return;
+    }
+
+    // edits refer to rows anywhere in the file.
+    line_index_load(INT64_MAX);
+
+    int64_t journal_len = swap_st.st_size - sizeof(header);
+    char* journal = malloc(journal_len > 0 ? journal_len : 1);
+    if (journal == NULL) die("Error while reading the swap file");
+    int64_t read_len = 0;
+    while (read_len < journal_len) {
+        ssize_t count = read(fd, &journal[read_len], journal_len - read_len);
+        if (count <= 0) break;
+        read_len += count;
+    }
+
+    int64_t edits = 0;
+    int64_t at    = 0;
+    while (at + SWAP_BATCH_HEADER <= read_len) {
+        Swap_Batch_Header batch_header;
+        memcpy(&batch_header, &journal[at], SWAP_BATCH_HEADER);
+        int64_t batch_len = batch_header.len;
+        if (batch_len < 0 || batch_len > read_len - at - SWAP_BATCH_HEADER) break;
+
+        const char* batch = &journal[at + SWAP_BATCH_HEADER];
+        if (swap_checksum(SWAP_CHECKSUM_SEED, batch, batch_len) != batch_header.checksum) break;
+        if (!swap_replay_batch(batch, batch_len, &edits)) break;
+        at += SWAP_BATCH_HEADER + batch_len;
+    }
+    free(journal);
+
+    // journaling goes on after the last good batch.
+    if (ftruncate(fd, sizeof(header) + at) == -1 || lseek(fd, 0, SEEK_END) == -1) {
+        close(fd);
+        swap_start();
+        return;
+    }
+
+    free(swap.path);
+    swap.path = swap_path(editor_state.filename);
+    swap.fd   = fd;
+
+    if (edits > 0) {
+        editor_state.dirty = edits;
+        editor_set_status_msg("Recovered %" PRId64 " edits from the swap file", edits);
+    }
+}
+
+// The buffer is closed on purpose, its journal isn't needed anymore.
+void swap_discard(void) {
+    if (swap.fd == -1) return;
+
+    swap_close();
+    unlink(swap.path);
+}
+
+/*** file i/o ***/
+
+// Row slices handed to one `writev`.
+#define EDITOR_SAVE_IOV 1024
+
+// Write every row followed by a newline to `fd`, straight from the rows in
+// batches of slices: nothing is copied. Rows still viewing the mapped file
+// are sent together with the newline after them, so a run of untouched rows
+// goes out as one slice. Returns the number of bytes written, -1 on error.
+long long editor_write_rows(int fd) {
+    struct iovec iov[EDITOR_SAVE_IOV];
+    int iov_count = 0;
+    long long written = 0;
+
+    Row_Iter it = row_iter_at(0);
+    Editor_Row* row = row_iter_next(&it);
+
+    while (row != NULL || iov_count > 0) {
+        while (row != NULL && iov_count + 2 <= EDITOR_SAVE_IOV) {
+            char* end = row->chars + row->size;
+            bool mapped_new_line = editor_row_is_mapped(row)
+                && end < editor_state.map + editor_state.map_size
+                && *end == '\n';
+
+            if (iov_count > 0 && (char*) iov[iov_count - 1].iov_base + iov[iov_count - 1].iov_len == row->chars) {
+                iov[iov_count - 1].iov_len += row->size;
+            } else {
+                iov[iov_count] = (struct iovec) { .iov_base = row->chars, .iov_len = row->size };
+                iov_count += 1;
+            }
+
+            if (mapped_new_line) {
+                iov[iov_count - 1].iov_len += 1;
+            } else {
+                iov[iov_count] = (struct iovec) { .iov_base = "\n", .iov_len = 1 };
+                iov_count += 1;
+            }
+
+            row = row_iter_next(&it);
+        }
+
+        // `writev` may write less than asked, the rest goes in the next call.
+        int at = 0;
+        while (at < iov_count) {
+            ssize_t count = writev(fd, &iov[at], iov_count - at);
+            if (count == -1) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            written += count;
+
+            while (at < iov_count && (size_t) count >= iov[at].iov_len) {
+                count -= iov[at].iov_len;
+                at    += 1;
+            }
+            if (at < iov_count) {
+                iov[at].iov_base  = (char*) iov[at].iov_base + count;
+                iov[at].iov_len  -= count;
+            }
+        }
+        iov_count = 0;
+    }
+
+    return written;
+}
+
+// Make a rename in the directory of `path` durable.
+void editor_sync_dir(const char* path) {
+    const char* slash = strrchr(path, '/');
+    char* dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+
+    int fd = open(dir, O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+// Map the file and make every row a view into the mapping, nothing is copied
+// until a row gets edited. Only the first screens are loaded here, the rest
+// as the line index gets through the file, see `line_index_idle`. Returns
+// false when the file can't be mapped (empty, not a regular file...) so the
+// caller can fall back on reading it.
+bool editor_open_mapped(char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    editor_state.map      = map;
+    editor_state.map_size = st.st_size;
+
+    line_index_start(fd, st.st_size);
+    line_index->loading = true;
+    line_index_load(editor_state.screen_rows * 2);
+    return true;
+}
+
+void editor_open(char* filename) {
+    free(editor_state.filename);
+    editor_state.filename = strdup(filename);
+
+    editor_select_syntax_highlight();
+    if (pager_open(filename)) return;
+
+    // Loading isn't an edit that can be undone, nor is replaying the swap
+    // file.
+    undo.paused = true;
+    if (!editor_open_mapped(filename)) {
+        FILE* fp = fopen(filename, "r");
+        if (!fp) die("Error while opening the file");
+
+        char* line       = NULL;
+        size_t line_cap  = 0;
+        ssize_t line_len;
+
+        while((line_len = getline(&line, &line_cap, fp)) != -1) {
+            while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+                line_len -= 1;
+            }
+
+            editor_insert_row(editor_state.rows_count, line, line_len);
+        }
+
+        free(line);
+        fclose(fp);
+    }
+    editor_state.dirty = 0;
+    swap_open();
+    undo.paused = false;
+    undo_clear();
+}
+
+void editor_save(void) {
+    if (editor_read_only()) return;
+    line_index_load(INT64_MAX);
+    if (editor_state.filename == NULL) {
+        editor_state.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
+        if (editor_state.filename == NULL) {
+            editor_set_status_msg("Save aborted");
+            return;
+        }
+
+        editor_select_syntax_highlight();
+    }
+
+    // The rows are written to a temporary file next to the target which then
+    // replaces it, so the file is never left half written. Rows viewing the
+    // mapped file keep viewing the old one, which stays around as long as it
+    // is mapped.
+    size_t temp_path_size = strlen(editor_state.filename) + 8;
+    char* temp_path = malloc(temp_path_size);
+    if (temp_path == NULL) die("Error while saving the file");
+    snprintf(temp_path, temp_path_size, "%s.XXXXXX", editor_state.filename);
+
+    long long len = -1;
+    int fd = mkstemp(temp_path);
+    if (fd != -1) {
+        struct stat st;
+        fchmod(fd, stat(editor_state.filename, &st) == 0 ? st.st_mode & 07777 : 0644);
+
+        len = editor_write_rows(fd);
+        if (len != -1 && fsync(fd) == -1) len = -1;
+        if (close(fd) == -1) len = -1;
+        if (len != -1 && rename(temp_path, editor_state.filename) == -1) len = -1;
+
+        if (len == -1) {
+            int saved_errno = errno;
+            unlink(temp_path);
+            errno = saved_errno;
+        }
+    }
+    free(temp_path);
+
+    if (len == -1) {
+        editor_set_status_msg("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+
+    editor_sync_dir(editor_state.filename);
+    editor_state.dirty = 0;
+    // the file holds every edit so far.
+    swap_start();
+    editor_set_status_msg("%lld bytes written to disk", len);
+}
+
+/*** regex ***/
+
+// Search patterns are compiled once to an NFA (Thompson's construction),
+// matched with DFAs built lazily from it: a DFA state is only made the first
+// time the text leads to it, so matching takes a table lookup per byte
+// whatever the pattern, without any backtracking. Bytes are matched, not
+// code points.
+//
+// Syntax: . [abc] [^a-z] * + ? {m} {m,} {m,n} | ( ) (?: ) and the \d \w \s
+// classes with their \D \W \S negations, ^ and $ matching at the start and
+// end of the line.
+#define REGEX_STATES_MAX  8192
+#define REGEX_REPEAT_MAX  1000
+// DFA states cached before the cache is flushed and built again.
+#define REGEX_DFA_MAX     4096
+#define REGEX_LITERAL_MAX 64
+// Transitions not taken yet, and to the state of no NFA state.
+#define REGEX_UNKNOWN     -1
+#define REGEX_DEAD        -2
+// Flags of a DFA state: it accepts, and whether it does at the edge of the
+// line it reads toward, ^ or $ being crossed there.
+#define REGEX_ACCEPT      1
+#define REGEX_EDGE_KNOWN  2
+#define REGEX_EDGE_ACCEPT 4
+
+typedef enum Regex_Node_Type {
+    REGEX_EMPTY = 0,
+    REGEX_CLASS,
+    REGEX_CONCAT,
+    REGEX_ALT,
+    REGEX_REPEAT,
+    REGEX_BOL,
+    REGEX_EOL
+} Regex_Node_Type;
+
+typedef enum Regex_State_Type {
+    REGEX_STATE_CLASS = 0,
+    REGEX_STATE_SPLIT,
+    REGEX_STATE_MATCH,
+    // only crossed at the start or the end of the line.
+    REGEX_STATE_BOL,
+    REGEX_STATE_EOL
+} Regex_State_Type;
+
+typedef struct Regex_Node {
+    Regex_Node_Type    type;
+    // REGEX_CLASS: the bytes it matches.
+    uint64_t           bits[4];
+    // REGEX_REPEAT: bounds of the count of `left`, -1 for no maximum.
+    int                min;
+    int                max;
+    struct Regex_Node* left;
+    struct Regex_Node* right;
+} Regex_Node;
+
+typedef struct Regex_Parser {
+    const char* pattern;
+    int         len;
+    int         at;
+    Regex_Node* nodes;
+    int         nodes_count;
+    const char* error;
+} Regex_Parser;
+
+typedef struct Regex_State {
+    Regex_State_Type type;
+    int              out;
+    // REGEX_STATE_SPLIT: the other way.
+    int              out1;
+    uint64_t         bits[4];
+} Regex_State;
+
+typedef struct Regex_Nfa {
+    Regex_State* states;
+    int          count;
+    int          start;
+    // Compile calls, bounding the work on patterns repeating empty groups.
+    int          steps;
+} Regex_Nfa;
+
+typedef struct Regex {
+    Regex_Nfa forward;
+    // The mirrored pattern, run from the end of a line to find where matches
+    // start.
+    Regex_Nfa backward;
+    // Bytes no class of the pattern tells apart share a class, a DFA state
+    // having a transition per class rather than per byte.
+    uint8_t   byte_class[256];
+    uint8_t   class_byte[256];
+    int       classes_count;
+    // A string every match holds, looked for first to skip the lines
+    // without it.
+    char      literal[REGEX_LITERAL_MAX];
+    int       literal_len;
+    // The pattern is only `literal`, no DFA is needed.
+    bool      pure;
+} Regex;
+
+typedef struct Regex_Dfa {
+    const Regex*     regex;
+    const Regex_Nfa* nfa;
+    // Starting over at each byte, for a match anywhere before.
+    bool             unanchored;
+    // The anchors crossed at the edge the DFA reads from and the one it
+    // reads toward.
+    Regex_State_Type edge_from;
+    Regex_State_Type edge_to;
+    // Per state: its transitions by byte class, its REGEX_ACCEPT flags and
+    // the sorted NFA states it stands for.
+    int32_t*         next;
+    uint8_t*         accepting;
+    int*             set_start;
+    int*             set_len;
+    int*             items;
+    int              items_count;
+    int              items_cap;
+    int              count;
+    int              cap;
+    int              start;
+    int              start_edge;
+    int              flushes;
+    // States by their NFA states, open addressing holding index + 1.
+    int*             table;
+    // Scratch for the closures.
+    uint32_t*        seen;
+    uint32_t         generation;
+    int*             stack;
+    int*             list;
+    int              list_count;
+} Regex_Dfa;
+
+// What a thread needs to match a compiled regex, the DFAs being filled as it
+// goes.
+typedef struct Regex_Matcher {
+    const Regex* regex;
+    Regex_Dfa    forward;
+    Regex_Dfa    backward;
+    // Whether a match starts at each position of the line scanned last.
+    uint8_t*     starts;
+    int64_t      starts_cap;
+} Regex_Matcher;
+
+void regex_class_set(uint64_t* bits, int c) {
+    bits[c >> 6] |= (uint64_t) 1 << (c & 63);
+}
+
+bool regex_class_has(const uint64_t* bits, int c) {
+    return (bits[c >> 6] >> (c & 63)) & 1;
+}
+
+// The byte of a class matching only one, -1 otherwise.
+int regex_class_single(const uint64_t* bits) {
+    int byte = -1;
+    for (int j = 0; j < 4; j += 1) {
+        if (bits[j] == 0) continue;
+        if (byte != -1 || (bits[j] & (bits[j] - 1))) return -1;
+        byte = j * 64 + __builtin_ctzll(bits[j]);
+    }
+    return byte;
+}
+
+// Add the class of the escape `\c` to `bits`, false if it isn't one.
+bool regex_escape_class(int c, uint64_t* bits) {
+    int kind = tolower(c);
+    if (kind != 'd' && kind != 'w' && kind != 's') return false;
+
+    uint64_t set[4] = { 0 };
+    for (int b = 0; b < 128; b += 1) {
+        bool in = (kind == 'd') ? isdigit(b) : (kind == 'w') ? (isalnum(b) || b == '_') : isspace(b);
+        if (in) regex_class_set(set, b);
+    }
+
+    for (int j = 0; j < 4; j += 1) {
+        bits[j] |= isupper(c) ? ~set[j] : set[j];
+    }
+    return true;
+}
+
+Regex_Node* regex_node(Regex_Parser* p, Regex_Node_Type type) {
+    Regex_Node* node = &p->nodes[p->nodes_count];
+    p->nodes_count += 1;
+    *node = (Regex_Node) { .type = type };
+    return node;
+}
+
+// The byte after a `\`, read as a plain char.
+int regex_parse_escaped(Regex_Parser* p) {
+    if (p->at == p->len) {
+        p->error = "trailing \\";
+        return -1;
+    }
+
+    int c  = (unsigned char) p->pattern[p->at];
+    p->at += 1;
+    return (c == 't') ? '\t' : c;
+}
+
+// A `[...]` class, the `[` being read.
+Regex_Node* regex_parse_class(Regex_Parser* p) {
+    Regex_Node* node = regex_node(p, REGEX_CLASS);
+    bool negate = p->at < p->len && p->pattern[p->at] == '^';
+    if (negate) p->at += 1;
+
+    // a `]` first is a plain char.
+    for (bool first = true; ; first = false) {
+        if (p->at == p->len) {
+            p->error = "missing ]";
+            return NULL;
+        }
+
+        int c  = (unsigned char) p->pattern[p->at];
+        p->at += 1;
+        if (c == ']' && !first) break;
+        if (c == '\\') {
+            if (p->at < p->len && regex_escape_class((unsigned char) p->pattern[p->at], node->bits)) {
+                p->at += 1;
+                continue;
+            }
+            c = regex_parse_escaped(p);
+            if (c == -1) return NULL;
+        }
+
+        int last = c;
+        if (p->at + 1 < p->len && p->pattern[p->at] == '-' && p->pattern[p->at + 1] != ']') {
+            p->at += 1;
+            last   = (unsigned char) p->pattern[p->at];
+            p->at += 1;
+            if (last == '\\') last = regex_parse_escaped(p);
+            if (last == -1) return NULL;
+            if (last < c) {
+                p->error = "bad range";
+                return NULL;
+            }
+        }
+        for (int b = c; b <= last; b += 1) regex_class_set(node->bits, b);
+    }
+
+    if (negate) {
+        for (int j = 0; j < 4; j += 1) node->bits[j] = ~node->bits[j];
+    }
+    return node;
+}
+
+Regex_Node* regex_parse_alt(Regex_Parser* p);
+
+Regex_Node* regex_parse_atom(Regex_Parser* p) {
+    int c  = (unsigned char) p->pattern[p->at];
+    p->at += 1;
+
+    if (c == '(') {
+        if (p->at + 1 < p->len && p->pattern[p->at] == '?' && p->pattern[p->at + 1] == ':') p->at += 2;
+        Regex_Node* node = regex_parse_alt(p);
+        if (node == NULL) return NULL;
+        if (p->at == p->len || p->pattern[p->at] != ')') {
+            p->error = "missing )";
+            return NULL;
+        }
+        p->at += 1;
+        return node;
+    }
+    if (c == '[') return regex_parse_class(p);
+    if (c == '^') return regex_node(p, REGEX_BOL);
+    if (c == '$') return regex_node(p, REGEX_EOL);
+
+    Regex_Node* node = regex_node(p, REGEX_CLASS);
+    if (c == '.') {
+        memset(node->bits, 0xff, sizeof(node->bits));
+    } else if (c == '\\') {
+        if (p->at < p->len && regex_escape_class((unsigned char) p->pattern[p->at], node->bits)) {
+            p->at += 1;
+        } else {
+            c = regex_parse_escaped(p);
+            if (c == -1) return NULL;
+            regex_class_set(node->bits, c);
+        }
+    } else {
+        regex_class_set(node->bits, c);
+    }
+    return node;
+}
+
+// A decimal count of a `{m,n}`, -1 when there is none.
+int regex_parse_count(Regex_Parser* p) {
+    if (p->at == p->len || !isdigit((unsigned char) p->pattern[p->at])) return -1;
+
+    int count = 0;
+    while (p->at < p->len && isdigit((unsigned char) p->pattern[p->at])) {
+        if (count <= REGEX_REPEAT_MAX) count = count * 10 + (p->pattern[p->at] - '0');
+        p->at += 1;
+    }
+    return count;
+}
+
+// Read `{m}`, `{m,}` or `{m,n}`. When it isn't one the `{` is a plain char
+// and nothing is read.
+bool regex_parse_bounds(Regex_Parser* p, int* min, int* max) {
+    int start = p->at;
+    p->at += 1;
+
+    *min = regex_parse_count(p);
+    *max = *min;
+    if (p->at < p->len && p->pattern[p->at] == ',') {
+        p->at += 1;
+        *max   = regex_parse_count(p);
+    }
+
+    if (*min == -1 || p->at == p->len || p->pattern[p->at] != '}') {
+        p->at = start;
+        return false;
+    }
+    p->at += 1;
+
+    if (*min > REGEX_REPEAT_MAX || *max > REGEX_REPEAT_MAX) {
+        p->error = "count too large";
+    } else if (*max != -1 && *max < *min) {
+        p->error = "bad count";
+    }
+    return true;
+}
+
+Regex_Node* regex_parse_repeat(Regex_Parser* p) {
+    Regex_Node* node = regex_parse_atom(p);
+
+    while (node != NULL && p->at < p->len) {
+        char c = p->pattern[p->at];
+        int min, max;
+        if (c == '*' || c == '+' || c == '?') {
+            min    = (c == '+');
+            max    = (c == '?') ? 1 : -1;
+            p->at += 1;
+        } else if (c != '{' || !regex_parse_bounds(p, &min, &max)) {
+            break;
+        }
+        if (p->error) return NULL;
+
+        Regex_Node* repeat = regex_node(p, REGEX_REPEAT);
+        repeat->min  = min;
+        repeat->max  = max;
+        repeat->left = node;
+        node         = repeat;
+    }
+    return node;
+}
+
+Regex_Node* regex_parse_concat(Regex_Parser* p) {
+    Regex_Node* node = NULL;
+
+    while (p->at < p->len && p->pattern[p->at] != '|' && p->pattern[p->at] != ')') {
+        char c = p->pattern[p->at];
+        if (c == '*' || c == '+' || c == '?') {
+            p->error = "nothing to repeat";
+            return NULL;
+        }
+
+        Regex_Node* next = regex_parse_repeat(p);
+        if (next == NULL) return NULL;
+        if (node == NULL) {
+            node = next;
+        } else {
+            Regex_Node* concat = regex_node(p, REGEX_CONCAT);
+            concat->left  = node;
+            concat->right = next;
+            node          = concat;
+        }
+    }
+
+    return node ? node : regex_node(p, REGEX_EMPTY);
+}
+
+Regex_Node* regex_parse_alt(Regex_Parser* p) {
+    Regex_Node* node = regex_parse_concat(p);
+
+    while (node != NULL && p->at < p->len && p->pattern[p->at] == '|') {
+        p->at += 1;
+        Regex_Node* right = regex_parse_concat(p);
+        if (right == NULL) return NULL;
+
+        Regex_Node* alt = regex_node(p, REGEX_ALT);
+        alt->left  = node;
+        alt->right = right;
+        node       = alt;
+    }
+    return node;
+}
+
+// A new state of `nfa`, -1 when the pattern is too large.
+int regex_nfa_state(Regex_Nfa* nfa, Regex_State_Type type, int out, int out1) {
+    if (nfa->count == REGEX_STATES_MAX) return -1;
+
+    nfa->states[nfa->count] = (Regex_State) { .type = type, .out = out, .out1 = out1 };
+    nfa->count += 1;
+    return nfa->count - 1;
+}
+
+// Compile `node` to states of `nfa` going on to `next`, and return the state
+// it starts from, -1 when the pattern is too large. It is built from its end,
+// so each part knows what follows it. `reverse` compiles the mirror of the
+// pattern.
+int regex_nfa_compile(Regex_Nfa* nfa, const Regex_Node* node, int next, bool reverse) {
+    nfa->steps += 1;
+    if (next < 0 || nfa->steps > REGEX_STATES_MAX * 16) return -1;
+
+    switch (node->type) {
+    case REGEX_EMPTY:
+        return next;
+    case REGEX_BOL:
+        return regex_nfa_state(nfa, REGEX_STATE_BOL, next, -1);
+    case REGEX_EOL:
+        return regex_nfa_state(nfa, REGEX_STATE_EOL, next, -1);
+    case REGEX_CLASS: {
+        int state = regex_nfa_state(nfa, REGEX_STATE_CLASS, next, -1);
+        if (state >= 0) memcpy(nfa->states[state].bits, node->bits, sizeof(node->bits));
+        return state;
+    }
+    case REGEX_CONCAT:
+        if (reverse) return regex_nfa_compile(nfa, node->right, regex_nfa_compile(nfa, node->left, next, reverse), reverse);
+        return regex_nfa_compile(nfa, node->left, regex_nfa_compile(nfa, node->right, next, reverse), reverse);
+    case REGEX_ALT: {
+        int left  = regex_nfa_compile(nfa, node->left, next, reverse);
+        int right = regex_nfa_compile(nfa, node->right, next, reverse);
+        if (left < 0 || right < 0) return -1;
+        return regex_nfa_state(nfa, REGEX_STATE_SPLIT, left, right);
+    }
+    case REGEX_REPEAT: {
+        // the optional part: a loop without maximum, nested choices to go on
+        // otherwise.
+        int state = next;
+        if (node->max == -1) {
+            int split = regex_nfa_state(nfa, REGEX_STATE_SPLIT, -1, next);
+            if (split < 0) return -1;
+            int body = regex_nfa_compile(nfa, node->left, split, reverse);
+            if (body < 0) return -1;
+            nfa->states[split].out = body;
+            state = split;
+        } else {
+            for (int j = node->min; j < node->max && state >= 0; j += 1) {
+                int body = regex_nfa_compile(nfa, node->left, state, reverse);
+                state = (body < 0) ? -1 : regex_nfa_state(nfa, REGEX_STATE_SPLIT, body, next);
+            }
+        }
+
+        for (int j = 0; j < node->min && state >= 0; j += 1) {
+            state = regex_nfa_compile(nfa, node->left, state, reverse);
+        }
+        return state;
+    }
+    }
+
+    return -1;
+}
+
+bool regex_nfa_build(Regex_Nfa* nfa, const Regex_Node* root, bool reverse) {
+    nfa->states = malloc(sizeof(Regex_State) * REGEX_STATES_MAX);
+    if (nfa->states == NULL) die("Error while compiling a regex");
+
+    int match  = regex_nfa_state(nfa, REGEX_STATE_MATCH, -1, -1);
+    nfa->start = regex_nfa_compile(nfa, root, match, reverse);
+    return nfa->start >= 0;
+}
+
+// Length of the only string `node` matches, -1 if it matches others.
+int regex_exact_len(const Regex_Node* node) {
+    switch (node->type) {
+    case REGEX_EMPTY:
+        return 0;
+    case REGEX_CLASS:
+        return (regex_class_single(node->bits) == -1) ? -1 : 1;
+    case REGEX_CONCAT: {
+        int left  = regex_exact_len(node->left);
+        int right = regex_exact_len(node->right);
+        return (left < 0 || right < 0) ? -1 : left + right;
+    }
+    default:
+        return -1;
+    }
+}
+
+typedef struct Regex_Literal {
+    char run[REGEX_LITERAL_MAX];
+    int  run_len;
+    char best[REGEX_LITERAL_MAX];
+    int  best_len;
+} Regex_Literal;
+
+void regex_literal_close(Regex_Literal* literal) {
+    if (literal->run_len > literal->best_len) {
+        memcpy(literal->best, literal->run, literal->run_len);
+        literal->best_len = literal->run_len;
+    }
+    literal->run_len = 0;
+}
+
+// Walk the pattern in the order of the text, growing the run of bytes every
+// match holds in a row and closing it at what may vary.
+void regex_literal_walk(Regex_Literal* literal, const Regex_Node* node) {
+    switch (node->type) {
+    case REGEX_EMPTY:
+    case REGEX_BOL:
+    case REGEX_EOL:
+        break;
+    case REGEX_CLASS: {
+        int byte = regex_class_single(node->bits);
+        if (byte == -1 || literal->run_len == REGEX_LITERAL_MAX) regex_literal_close(literal);
+        if (byte != -1) {
+            literal->run[literal->run_len]  = byte;
+            literal->run_len               += 1;
+        }
+        break;
+    }
+    case REGEX_CONCAT:
+        regex_literal_walk(literal, node->left);
+        regex_literal_walk(literal, node->right);
+        break;
+    case REGEX_REPEAT:
+        if (node->min == 0) {
+            regex_literal_close(literal);
+            break;
+        }
+        // the first repetition follows what comes before, the last one
+        // comes before what follows.
+        regex_literal_walk(literal, node->left);
+        if (node->max != 1) {
+            regex_literal_close(literal);
+            regex_literal_walk(literal, node->left);
+        }
+        break;
+    default:
+        regex_literal_close(literal);
+    }
+}
+
+void regex_byte_classes(Regex* regex) {
+    memset(regex->byte_class, 0, sizeof(regex->byte_class));
+    regex->classes_count = 1;
+
+    // split the classes so far by each class of the pattern.
+    for (int j = 0; j < regex->forward.count; j += 1) {
+        Regex_State* state = &regex->forward.states[j];
+        if (state->type != REGEX_STATE_CLASS) continue;
+
+        int remap[512];
+        memset(remap, -1, sizeof(remap));
+        int count = 0;
+        for (int b = 0; b < 256; b += 1) {
+            int key = regex->byte_class[b] * 2 + regex_class_has(state->bits, b);
+            if (remap[key] == -1) {
+                remap[key]  = count;
+                count      += 1;
+            }
+            regex->byte_class[b] = remap[key];
+        }
+        regex->classes_count = count;
+    }
+
+    for (int b = 255; b >= 0; b -= 1) regex->class_byte[regex->byte_class[b]] = b;
+}
+
+void regex_free(Regex* regex) {
+    free(regex->forward.states);
+    free(regex->backward.states);
+    free(regex);
+}
+
+// Compile `pattern`, NULL with `*error` set when it isn't valid.
+Regex* regex_compile(const char* pattern, const char** error) {
+    Regex* regex = calloc(1, sizeof(Regex));
+    if (regex == NULL) die("Error while compiling a regex");
+
+    Regex_Parser p = { .pattern = pattern, .len = strlen(pattern) };
+    p.nodes = malloc(sizeof(Regex_Node) * (3 * p.len + 4));
+    if (p.nodes == NULL) die("Error while compiling a regex");
+
+    Regex_Node* root = regex_parse_alt(&p);
+    if (root != NULL && p.at < p.len) p.error = "unmatched )";
+    if (root != NULL && p.error == NULL) {
+        if (!regex_nfa_build(&regex->forward, root, false) || !regex_nfa_build(&regex->backward, root, true)) {
+            p.error = "pattern too large";
+        }
+    }
+
+    if (p.error == NULL) {
+        Regex_Literal literal = { 0 };
+        regex_literal_walk(&literal, root);
+        regex_literal_close(&literal);
+        memcpy(regex->literal, literal.best, literal.best_len);
+        regex->literal_len = literal.best_len;
+        regex->pure        = literal.best_len > 0 && regex_exact_len(root) == literal.best_len;
+
+        regex_byte_classes(regex);
+    }
+    free(p.nodes);
+
+    if (p.error) {
+        *error = p.error;
+        regex_free(regex);
+        return NULL;
+    }
+    return regex;
+}
+
+void regex_dfa_flush(Regex_Dfa* dfa) {
+    dfa->count        = 0;
+    dfa->items_count  = 0;
+    dfa->start        = REGEX_UNKNOWN;
+    dfa->start_edge   = REGEX_UNKNOWN;
+    dfa->flushes     += 1;
+    memset(dfa->table, 0, sizeof(int) * REGEX_DFA_MAX * 2);
+}
+
+void regex_dfa_init(Regex_Dfa* dfa, const Regex* regex, const Regex_Nfa* nfa, bool backward) {
+    *dfa = (Regex_Dfa) {
+        .regex      = regex,
+        .nfa        = nfa,
+        .unanchored = backward,
+        .edge_from  = backward ? REGEX_STATE_EOL : REGEX_STATE_BOL,
+        .edge_to    = backward ? REGEX_STATE_BOL : REGEX_STATE_EOL,
+        .table      = malloc(sizeof(int) * REGEX_DFA_MAX * 2),
+        .seen       = calloc(nfa->count, sizeof(uint32_t)),
+        .stack      = malloc(sizeof(int) * (nfa->count * 2 + 2)),
+        .list       = malloc(sizeof(int) * nfa->count),
+    };
+    if (dfa->table == NULL || dfa->seen == NULL || dfa->stack == NULL || dfa->list == NULL) {
+        die("Error while matching a regex");
+    }
+    regex_dfa_flush(dfa);
+}
+
+void regex_dfa_free(Regex_Dfa* dfa) {
+    free(dfa->next);
+    free(dfa->accepting);
+    free(dfa->set_start);
+    free(dfa->set_len);
+    free(dfa->items);
+    free(dfa->table);
+    free(dfa->seen);
+    free(dfa->stack);
+    free(dfa->list);
+}
+
+void regex_dfa_list_begin(Regex_Dfa* dfa) {
+    dfa->generation += 1;
+    if (dfa->generation == 0) {
+        memset(dfa->seen, 0, sizeof(uint32_t) * dfa->nfa->count);
+        dfa->generation = 1;
+    }
+    dfa->list_count = 0;
+}
+
+// Add the NFA states reached from `state` without reading a byte to the list,
+// the splits being followed through.
+void regex_dfa_closure(Regex_Dfa* dfa, int state) {
+    int top = 0;
+    dfa->stack[top] = state;
+    top += 1;
+
+    while (top > 0) {
+        top -= 1;
+        int at = dfa->stack[top];
+        if (dfa->seen[at] == dfa->generation) continue;
+        dfa->seen[at] = dfa->generation;
+
+        const Regex_State* s = &dfa->nfa->states[at];
+        if (s->type == REGEX_STATE_SPLIT) {
+            dfa->stack[top]      = s->out1;
+            dfa->stack[top + 1]  = s->out;
+            top                 += 2;
+        } else {
+            dfa->list[dfa->list_count]  = at;
+            dfa->list_count            += 1;
+        }
+    }
+}
+
+int regex_int_compare(const void* a, const void* b) {
+    return *(const int*) a - *(const int*) b;
+}
+
+// The DFA state of the NFA states in the list, made if it doesn't exist. A
+// full cache is flushed first.
+int regex_dfa_add(Regex_Dfa* dfa) {
+    if (dfa->list_count == 0) return REGEX_DEAD;
+    qsort(dfa->list, dfa->list_count, sizeof(int), regex_int_compare);
+
+    uint32_t hash = 2166136261u;
+    for (int j = 0; j < dfa->list_count; j += 1) hash = (hash ^ dfa->list[j]) * 16777619u;
+
+    int mask = REGEX_DFA_MAX * 2 - 1;
+    int slot = hash & mask;
+    for (; dfa->table[slot]; slot = (slot + 1) & mask) {
+        int state = dfa->table[slot] - 1;
+        if (dfa->set_len[state] == dfa->list_count
+            && !memcmp(&dfa->items[dfa->set_start[state]], dfa->list, sizeof(int) * dfa->list_count)) {
+            return state;
+        }
+    }
+
+    if (dfa->count == REGEX_DFA_MAX) {
+        regex_dfa_flush(dfa);
+        slot = hash & mask;
+    }
+
+    int classes = dfa->regex->classes_count;
+    if (dfa->count == dfa->cap) {
+        dfa->cap       = dfa->cap ? dfa->cap * 2 : 16;
+        dfa->next      = realloc(dfa->next, sizeof(int32_t) * dfa->cap * classes);
+        dfa->accepting = realloc(dfa->accepting, dfa->cap);
+        dfa->set_start = realloc(dfa->set_start, sizeof(int) * dfa->cap);
+        dfa->set_len   = realloc(dfa->set_len, sizeof(int) * dfa->cap);
+    }
+    if (dfa->items_count + dfa->list_count > dfa->items_cap) {
+        dfa->items_cap = (dfa->items_count + dfa->list_count) * 2;
+        dfa->items     = realloc(dfa->items, sizeof(int) * dfa->items_cap);
+    }
+    if (dfa->next == NULL || dfa->accepting == NULL || dfa->set_start == NULL || dfa->set_len == NULL || dfa->items == NULL) {
+        die("Error while matching a regex");
+    }
+
+    int state = dfa->count;
+    dfa->count += 1;
+    memcpy(&dfa->items[dfa->items_count], dfa->list, sizeof(int) * dfa->list_count);
+    dfa->set_start[state]  = dfa->items_count;
+    dfa->set_len[state]    = dfa->list_count;
+    dfa->items_count      += dfa->list_count;
+    // the match state is the first of the NFA, so first in the sorted list.
+    dfa->accepting[state]  = (dfa->nfa->states[dfa->list[0]].type == REGEX_STATE_MATCH) ? REGEX_ACCEPT : 0;
+    for (int c = 0; c < classes; c += 1) dfa->next[state * classes + c] = REGEX_UNKNOWN;
+    dfa->table[slot] = state + 1;
+    return state;
+}
+
+// Cross the anchors of `type` in the list, the states they lead to being
+// added to it in turn.
+void regex_dfa_cross(Regex_Dfa* dfa, Regex_State_Type type) {
+    for (int j = 0; j < dfa->list_count; j += 1) {
+        const Regex_State* s = &dfa->nfa->states[dfa->list[j]];
+        if (s->type == type) regex_dfa_closure(dfa, s->out);
+    }
+}
+
+// The state to start from, at the edge of the line or not.
+int regex_dfa_start(Regex_Dfa* dfa, bool edge) {
+    int* start = edge ? &dfa->start_edge : &dfa->start;
+    if (*start == REGEX_UNKNOWN) {
+        regex_dfa_list_begin(dfa);
+        regex_dfa_closure(dfa, dfa->nfa->start);
+        if (edge) regex_dfa_cross(dfa, dfa->edge_from);
+        int state = regex_dfa_add(dfa);
+        // a flush reset both.
+        start  = edge ? &dfa->start_edge : &dfa->start;
+        *start = state;
+    }
+    return *start;
+}
+
+// Whether `state` accepts once at the edge of the line it reads toward.
+bool regex_dfa_accepts_edge(Regex_Dfa* dfa, int state) {
+    if (!(dfa->accepting[state] & REGEX_EDGE_KNOWN)) {
+        regex_dfa_list_begin(dfa);
+        for (int j = 0; j < dfa->set_len[state]; j += 1) {
+            regex_dfa_closure(dfa, dfa->items[dfa->set_start[state] + j]);
+        }
+        regex_dfa_cross(dfa, dfa->edge_to);
+
+        bool accepts = false;
+        for (int j = 0; j < dfa->list_count; j += 1) {
+            if (dfa->nfa->states[dfa->list[j]].type == REGEX_STATE_MATCH) accepts = true;
+        }
+        dfa->accepting[state] |= REGEX_EDGE_KNOWN | (accepts ? REGEX_EDGE_ACCEPT : 0);
+    }
+    return dfa->accepting[state] & REGEX_EDGE_ACCEPT;
+}
+
+// The state after reading a byte of the class `c` in `state`, the slow path
+// of a transition not known yet.
+int regex_dfa_step(Regex_Dfa* dfa, int state, int c) {
+    int classes = dfa->regex->classes_count;
+    int cached  = dfa->next[state * classes + c];
+    if (cached != REGEX_UNKNOWN) return cached;
+
+    int byte = dfa->regex->class_byte[c];
+    regex_dfa_list_begin(dfa);
+    for (int j = 0; j < dfa->set_len[state]; j += 1) {
+        const Regex_State* s = &dfa->nfa->states[dfa->items[dfa->set_start[state] + j]];
+        if (s->type == REGEX_STATE_CLASS && regex_class_has(s->bits, byte)) regex_dfa_closure(dfa, s->out);
+    }
+    if (dfa->unanchored) regex_dfa_closure(dfa, dfa->nfa->start);
+
+    int flushes = dfa->flushes;
+    int next    = regex_dfa_add(dfa);
+    // after a flush `state` is gone.
+    if (dfa->flushes == flushes) dfa->next[state * classes + c] = next;
+    return next;
+}
+
+void regex_matcher_init(Regex_Matcher* matcher, const Regex* regex) {
+    *matcher = (Regex_Matcher) { .regex = regex };
+    regex_dfa_init(&matcher->forward, regex, &regex->forward, false);
+    regex_dfa_init(&matcher->backward, regex, &regex->backward, true);
+}
+
+void regex_matcher_free(Regex_Matcher* matcher) {
+    regex_dfa_free(&matcher->forward);
+    regex_dfa_free(&matcher->backward);
+    free(matcher->starts);
+}
+
+// Get ready to go through the matches of the line `text`, finding where they
+// start by reading it backward with the mirrored pattern. Returns false when
+// it has none, the lines without the literal of the pattern being skipped at
+// the speed of find_memmem.
+bool regex_scan(Regex_Matcher* matcher, const char* text, int64_t len) {
+    const Regex* regex = matcher->regex;
+    if (regex->literal_len > 0 && find_memmem(text, len, regex->literal, regex->literal_len) == NULL) return false;
+    if (regex->pure) return true;
+
+    if (matcher->starts_cap < len + 1) {
+        matcher->starts_cap = len + 1;
+        matcher->starts     = realloc(matcher->starts, matcher->starts_cap);
+        if (matcher->starts == NULL) die("Error while matching a regex");
+    }
+
+    Regex_Dfa* dfa = &matcher->backward;
+    int classes = regex->classes_count;
+    int state   = regex_dfa_start(dfa, true);
+    matcher->starts[len] = dfa->accepting[state] & REGEX_ACCEPT;
+
+    for (int64_t i = len - 1; i >= 0; i -= 1) {
+        int c    = regex->byte_class[(unsigned char) text[i]];
+        int next = dfa->next[state * classes + c];
+        if (next < 0) next = regex_dfa_step(dfa, state, c);
+        if (next == REGEX_DEAD) {
+            memset(matcher->starts, 0, i + 1);
+            state = REGEX_DEAD;
+            break;
+        }
+
+        state = next;
+        matcher->starts[i] = dfa->accepting[state] & REGEX_ACCEPT;
+    }
+    if (state != REGEX_DEAD) matcher->starts[0] = regex_dfa_accepts_edge(dfa, state);
+
+    return memchr(matcher->starts, 1, len + 1) != NULL;
+}
+
+// End of the longest match starting at `start` in the line `text`, -1 if no
+// match starts there.
+int64_t regex_match_end(Regex_Matcher* matcher, const char* text, int64_t len, int64_t start) {
+    const Regex* regex = matcher->regex;
+    if (regex->pure) {
+        bool found = start + regex->literal_len <= len && !memcmp(&text[start], regex->literal, regex->literal_len);
+        return found ? start + regex->literal_len : -1;
+    }
+
+    Regex_Dfa* dfa = &matcher->forward;
+    int classes = regex->classes_count;
+    int state   = regex_dfa_start(dfa, start == 0);
+    int64_t end = (dfa->accepting[state] & REGEX_ACCEPT) ? start : -1;
+
+    int64_t i = start;
+    for (; i < len; i += 1) {
+        int c    = regex->byte_class[(unsigned char) text[i]];
+        int next = dfa->next[state * classes + c];
+        if (next < 0) next = regex_dfa_step(dfa, state, c);
+        if (next == REGEX_DEAD) break;
+
+        state = next;
+        if (dfa->accepting[state] & REGEX_ACCEPT) end = i + 1;
+    }
+    if (i == len && regex_dfa_accepts_edge(dfa, state)) end = len;
+
+    return end;
+}
+
+// The next match in the line `text` from `*at` on, after regex_scan. Matches
+// don't overlap, each being the longest at the leftmost place left. Empty
+// matches are skipped.
+bool regex_next(Regex_Matcher* matcher, const char* text, int64_t len, int64_t* at, int64_t* start, int64_t* end) {
+    const Regex* regex = matcher->regex;
+
+    while (*at <= len) {
+        int64_t from;
+        if (regex->pure) {
+            const char* found = find_memmem(&text[*at], len - *at, regex->literal, regex->literal_len);
+            if (found == NULL) return false;
+            from = found - text;
+        } else {
+            const uint8_t* found = memchr(&matcher->starts[*at], 1, len + 1 - *at);
+            if (found == NULL) return false;
+            from = found - matcher->starts;
+        }
+
+        int64_t to = regex_match_end(matcher, text, len, from);
+        if (to > from) {
+            *start = from;
+            *end   = to;
+            *at    = to;
+            return true;
+        }
+        *at = from + 1;
+    }
+
+    return false;
+}
+
+/*** find ***/
+
+// Every match of the current query, positions being in chars. Extending the
+// query only re-checks these instead of scanning the file again.
+#define EDITOR_FIND_MATCHES_MAX (1 << 22)
+// Full scans are split in row ranges searched in parallel, a range getting
+// at least EDITOR_FIND_WORKER_ROWS rows.
+#define EDITOR_FIND_WORKERS_MAX 16
+#define EDITOR_FIND_WORKER_ROWS 4096
+
+typedef struct Find_Match {
+    int64_t row;
+    int64_t col;
+} Find_Match;
+
+typedef struct Find_Matches {
+    Find_Match* items;
+    int         count;
+    int         cap;
+} Find_Matches;
+
+typedef struct Find_Worker {
+    pthread_t    thread;
+    Row_Iter     it;
+    int64_t      row_start;
+    int64_t      row_end;
+    // Past its share of EDITOR_FIND_MATCHES_MAX, matches are only counted.
+    Find_Matches matches;
+    int          matches_max;
+    _Atomic int64_t found;
+    atomic_bool  done;
+} Find_Worker;
+
+typedef struct Find_State {
+    char*         query;
+    int           query_len;
+    // Matches of the workers merged so far, always a prefix of the full set.
+    Find_Matches  matches;
+    int64_t       total;
+    int           current;
+    Find_Worker   workers[EDITOR_FIND_WORKERS_MAX];
+    int           workers_count;
+    int           workers_merged;
+    atomic_bool   cancel;
+    int64_t       saved_hl_line;
+    char*         saved_hl;
+    // Regex mode, toggled with Ctrl-R in the prompt: `pattern` compiled,
+    // `compiled` being NULL when it doesn't compile.
+    bool          regex;
+    char*         pattern;
+    Regex*        compiled;
+    const char*   regex_error;
+    Regex_Matcher matcher;
+} Find_State;
+
+Find_State find_state = { .current = -1 };
+
+// The prompt of the search, telling the mode and why a regex doesn't compile.
+char find_prompt[128];
+
+// First occurrence of `needle` in `hay`, neither needing to be NUL-terminated.
+// Candidates are found 16 bytes at a time by comparing the first and last
+// byte of the needle at once, then confirmed with memcmp.
+const char* find_memmem(const char* hay, int64_t hay_len, const char* needle, int needle_len) {
+    if (needle_len == 0 || hay_len < needle_len) return NULL;
+    if (needle_len == 1) return memchr(hay, needle[0], hay_len);
+
+    int64_t last = hay_len - needle_len;
+    int64_t i = 0;
+
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i final = _mm_set1_epi8(needle[needle_len - 1]);
+
+    for (; i + 15 <= last; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*) &hay[i]);
+        __m128i block_final = _mm_loadu_si128((const __m128i*) &hay[i + needle_len - 1]);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(final, block_final)));
+
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (!memcmp(&hay[i + bit + 1], &needle[1], needle_len - 2)) return &hay[i + bit];
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i <= last; i += 1) {
+        if (hay[i] == needle[0] && hay[i + needle_len - 1] == needle[needle_len - 1] && !memcmp(&hay[i], needle, needle_len)) {
+            return &hay[i];
+        }
+    }
+
+    return NULL;
+}
+
+void find_matches_push(Find_Matches* matches, int64_t row, int64_t col) {
+    if (matches->count == matches->cap) {
+        matches->cap   = matches->cap ? matches->cap * 2 : 64;
+        matches->items = realloc(matches->items, sizeof(Find_Match) * matches->cap);
+        if (matches->items == NULL) die("Error while collecting search matches");
+    }
+
+    matches->items[matches->count].row  = row;
+    matches->items[matches->count].col  = col;
+    matches->count                     += 1;
+}
+
+// Collect every occurrence of the query in the worker's rows, overlapping
+// ones included so that the set can later be narrowed to a longer query. The
+// rows are only read, the main thread doesn't modify the text while a
+// search runs.
+void find_worker_literal(Find_Worker* worker) {
+    const char* query = find_state.query;
+    int query_len     = find_state.query_len;
+
+    for (int64_t row_at = worker->row_start; row_at < worker->row_end; row_at += 1) {
+        if (row_at % ROW_TREE_LEAF_CAP == 0 && atomic_load(&find_state.cancel)) break;
+
+        Editor_Row* row = row_iter_next(&worker->it);
+        int64_t col = 0;
+        const char* match;
+        while ((match = find_memmem(&row->chars[col], row->size - col, query, query_len)) != NULL) {
+            col = match - row->chars;
+            if (worker->matches.count < worker->matches_max) {
+                find_matches_push(&worker->matches, row_at, col);
+            }
+            atomic_fetch_add(&worker->found, 1);
+            col += 1;
+        }
+    }
+}
+
+// Same with the compiled regex, whose matches in a row don't overlap. The
+// worker matches with DFAs of its own.
+void find_worker_regex(Find_Worker* worker) {
+    Regex_Matcher matcher;
+    regex_matcher_init(&matcher, find_state.compiled);
+
+    for (int64_t row_at = worker->row_start; row_at < worker->row_end; row_at += 1) {
+        if (row_at % ROW_TREE_LEAF_CAP == 0 && atomic_load(&find_state.cancel)) break;
+
+        Editor_Row* row = row_iter_next(&worker->it);
+        if (!regex_scan(&matcher, row->chars, row->size)) continue;
+
+        int64_t at = 0;
+        int64_t start, end;
+        while (regex_next(&matcher, row->chars, row->size, &at, &start, &end)) {
+            if (worker->matches.count < worker->matches_max) {
+                find_matches_push(&worker->matches, row_at, start);
+            }
+            atomic_fetch_add(&worker->found, 1);
+        }
+    }
+
+    regex_matcher_free(&matcher);
+}
+
+void* find_worker_run(void* arg) {
+    Find_Worker* worker = arg;
+    if (find_state.regex) {
+        find_worker_regex(worker);
+    } else {
+        find_worker_literal(worker);
+    }
+
+    atomic_store(&worker->done, true);
+    editor_wake();
+    return NULL;
+}
+
+// Split the file between workers and start them on `find_state.query`.
+void find_start(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int64_t count = editor_state.rows_count / EDITOR_FIND_WORKER_ROWS;
+    if (count > cpus) count = cpus;
+    if (count > EDITOR_FIND_WORKERS_MAX) count = EDITOR_FIND_WORKERS_MAX;
+    if (count < 1) count = 1;
+
+    atomic_store(&find_state.cancel, false);
+    find_state.workers_count  = count;
+    find_state.workers_merged = 0;
+
+    for (int j = 0; j < count; j += 1) {
+        Find_Worker* worker = &find_state.workers[j];
+        worker->row_start   = editor_state.rows_count * j / count;
+        worker->row_end     = editor_state.rows_count * (j + 1) / count;
+        worker->it          = row_iter_at(worker->row_start);
+        worker->matches     = (Find_Matches) { 0 };
+        worker->matches_max = EDITOR_FIND_MATCHES_MAX / count;
+        atomic_store(&worker->found, 0);
+        atomic_store(&worker->done, false);
+
+        if (pthread_create(&worker->thread, NULL, find_worker_run, worker) != 0) {
+            die("Error while starting a search worker");
+        }
+    }
+}
+
+// Merge the workers that are done into `find_state.matches`, in file order,
+// and refresh the total. With `wait`, block until the next one is done.
+void find_collect(bool wait) {
+    if (find_state.workers_count == 0) return;
+
+    while (find_state.workers_merged < find_state.workers_count) {
+        Find_Worker* worker = &find_state.workers[find_state.workers_merged];
+        if (!wait && !atomic_load(&worker->done)) break;
+        wait = false;
+
+        pthread_join(worker->thread, NULL);
+        for (int j = 0; j < worker->matches.count; j += 1) {
+            find_matches_push(&find_state.matches, worker->matches.items[j].row, worker->matches.items[j].col);
+        }
+        free(worker->matches.items);
+        worker->matches = (Find_Matches) { 0 };
+        find_state.workers_merged += 1;
+    }
+
+    find_state.total = 0;
+    for (int j = 0; j < find_state.workers_count; j += 1) {
+        find_state.total += atomic_load(&find_state.workers[j].found);
+    }
+}
+
+bool find_running(void) {
+    return find_state.workers_merged < find_state.workers_count;
+}
+
+// Stop the workers of a search still in flight and drop what they found.
+void find_cancel(void) {
+    atomic_store(&find_state.cancel, true);
+
+    for (int j = find_state.workers_merged; j < find_state.workers_count; j += 1) {
+        pthread_join(find_state.workers[j].thread, NULL);
+        free(find_state.workers[j].matches.items);
+        find_state.workers[j].matches = (Find_Matches) { 0 };
+    }
+
+    find_state.workers_count  = 0;
+    find_state.workers_merged = 0;
+}
+
+// The query got longer: a match of it is a match of the old one, so only the
+// old matches are checked for the added bytes.
+void find_narrow(const char* query, int query_len) {
+    int count      = 0;
+    int64_t row_at = -1;
+    Editor_Row* row = NULL;
+
+    for (int j = 0; j < find_state.matches.count; j += 1) {
+        Find_Match match = find_state.matches.items[j];
+        if (match.row != row_at) {
+            row_at = match.row;
+            row = editor_row_at(row_at);
+        }
+
+        if (match.col + query_len <= row->size && !memcmp(&row->chars[match.col], query, query_len)) {
+            find_state.matches.items[count] = match;
+            count += 1;
+        }
+    }
+
+    find_state.matches.count = count;
+    find_state.total         = count;
+}
+
+void find_update_prompt(void) {
+    const char* mode = find_state.regex ? "Regex search" : "Search";
+    if (find_state.regex && find_state.regex_error) {
+        snprintf(find_prompt, sizeof(find_prompt), "%s: %%s (%s)", mode, find_state.regex_error);
+    } else {
+        snprintf(find_prompt, sizeof(find_prompt), "%s: %%s (Use ESC/Arrows/Enter, Ctrl-R = regex)", mode);
+    }
+}
+
+void find_toggle_regex(void) {
+    find_state.regex = !find_state.regex;
+    find_update_prompt();
+}
+
+// Free the compiled regex, no search using it being in flight.
+void find_drop_regex(void) {
+    if (find_state.compiled) {
+        regex_matcher_free(&find_state.matcher);
+        regex_free(find_state.compiled);
+    }
+    free(find_state.pattern);
+    find_state.pattern     = NULL;
+    find_state.compiled    = NULL;
+    find_state.regex_error = NULL;
+}
+
+// Compile `query` for the regex mode, unless it is the pattern compiled
+// already. Returns false when it doesn't compile.
+bool find_compile(const char* query) {
+    if (find_state.pattern && !strcmp(find_state.pattern, query)) return find_state.compiled != NULL;
+
+    find_drop_regex();
+    find_state.pattern  = strdup(query);
+    find_state.compiled = regex_compile(query, &find_state.regex_error);
+    if (find_state.compiled) regex_matcher_init(&find_state.matcher, find_state.compiled);
+    find_update_prompt();
+    return find_state.compiled != NULL;
+}
+
+void find_set_query(const char* query) {
+    int query_len = strlen(query);
+
+    // a longer regex may match what the shorter one didn't.
+    bool extends = !find_state.regex
+        && find_state.query != NULL
+        && !find_running()
+        && find_state.total == find_state.matches.count
+        && find_state.query_len > 0
+        && query_len > find_state.query_len
+        && !memcmp(query, find_state.query, find_state.query_len);
+
+    find_cancel();
+
+    free(find_state.query);
+    find_state.query     = strdup(query);
+    find_state.query_len = query_len;
+    find_state.current   = -1;
+
+    if (extends) {
+        find_narrow(query, query_len);
+    } else {
+        find_state.matches.count = 0;
+        find_state.total         = 0;
+        bool valid = !find_state.regex || find_compile(query);
+        if (query_len > 0 && valid) find_start();
+    }
+}
+
+// Wait for the first match of the file to be known, giving up as soon as a
+// key is pressed. Workers after the first one may still be running.
+void find_wait_first(void) {
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO,        .events = POLLIN },
+        { .fd = editor_wake_pipe[0], .events = POLLIN },
+    };
+
+    // a replay always has its next key ready, it waits for the match instead.
+    int nfds = replay.enabled ? 1 : 2;
+
+    find_collect(false);
+    while (find_state.matches.count == 0 && find_running()) {
+        if (poll(&fds[2 - nfds], nfds, -1) > 0 && fds[0].revents) return;
+        editor_wake_drain();
+        find_collect(false);
+    }
+}
+
+void find_restore_highlight(void) {
+    if (find_state.saved_hl == NULL) return;
+
+    Row_Cache* saved_cache = editor_row_cache_peek(find_state.saved_hl_line);
+    if (saved_cache && saved_cache->hl) memcpy(saved_cache->hl, find_state.saved_hl, saved_cache->render_size);
+    free(find_state.saved_hl);
+    find_state.saved_hl = NULL;
+}
+
+// Move the cursor on the `len` chars at `col` in the row `at` and highlight
+// them.
+void find_highlight(int64_t at, int64_t col, int64_t len) {
+    Row_Cache* cache;
+    Editor_Row* row = editor_row_rendered(at, &cache);
+    editor_state.cursor_y   = at;
+    editor_state.cursor_x   = col;
+    editor_state.row_offset = editor_state.rows_count;
+
+    int64_t render_start = editor_row_cursor_x_to_render_x(row, cache, col);
+    int64_t render_end   = editor_row_cursor_x_to_render_x(row, cache, col + len);
+
+    find_state.saved_hl_line = at;
+    find_state.saved_hl = malloc(cache->render_size);
+    if (find_state.saved_hl == NULL) die("Error while highlighting a match");
+    memcpy(find_state.saved_hl, cache->hl, cache->render_size);
+    memset(&cache->hl[render_start], HL_MATCH, render_end - render_start);
+}
+
+// Move the cursor on the current match and highlight it.
+void find_show_current(void) {
+    Find_Match match = find_state.matches.items[find_state.current];
+    int64_t len = find_state.query_len;
+    if (find_state.regex) {
+        Editor_Row* row = editor_row_at(match.row);
+        len = regex_match_end(&find_state.matcher, row->chars, row->size, match.col) - match.col;
+    }
+    find_highlight(match.row, match.col, len);
+}
+
+// Called while waiting for a key: merge what the workers found since last
+// time. Returns true when the screen needs a refresh.
+bool find_idle(void) {
+    if (find_state.workers_count == 0) return false;
+
+    int64_t old_total = find_state.total;
+    find_collect(false);
+
+    if (find_state.current == -1 && find_state.matches.count > 0) {
+        find_state.current = 0;
+        find_show_current();
+        return true;
+    }
+
+    return find_state.total != old_total;
+}
+
+void find_reset(void) {
+    find_cancel();
+    find_restore_highlight();
+    find_drop_regex();
+    free(find_state.query);
+    free(find_state.matches.items);
+    find_state.query     = NULL;
+    find_state.query_len = 0;
+    find_state.matches   = (Find_Matches) { 0 };
+    find_state.total     = 0;
+    find_state.current   = -1;
+}
+
+void editor_find_callback(char* query, int key) {
+    find_restore_highlight();
+
+    if (key == '\r' || key == '\x1b') {
+        find_reset();
+        return;
+    } else if(key == MOVE_RIGHT || key == MOVE_DOWN) {
+        // Stepping past the merged matches waits for the next worker.
+        while (find_state.current + 1 >= find_state.matches.count && find_running()) {
+            find_collect(true);
+        }
+        if (find_state.matches.count > 0) {
+            find_state.current = (find_state.current + 1) % find_state.matches.count;
+        }
+    } else if(key == MOVE_LEFT || key == MOVE_UP) {
+        if (find_state.current <= 0) {
+            while (find_running()) find_collect(true);
+        }
+        if (find_state.matches.count > 0) {
+            find_state.current = (find_state.current <= 0) ? find_state.matches.count - 1 : find_state.current - 1;
+        }
+    } else if (key == CTRL_KEY('r') || find_state.query == NULL || strcmp(query, find_state.query)) {
+        if (key == CTRL_KEY('r')) find_toggle_regex();
+        find_set_query(query);
+        find_wait_first();
+        if (find_state.matches.count > 0) find_state.current = 0;
+    }
+
+    if (find_state.current == -1) return;
+
+    find_show_current();
+}
+
+void editor_find(void) {
+    int64_t saved_cursor_x   = editor_state.cursor_x;
+    int64_t saved_cursor_y   = editor_state.cursor_y;
+    int64_t saved_col_offset = editor_state.col_offset;
+    int64_t saved_row_offset = editor_state.row_offset;
+
+    void (*callback)(char*, int) = editor_find_callback;
+    if (pager.enabled) {
+        pager_find_start();
+        callback = pager_find_callback;
+    } else {
+        // the workers search every row.
+        line_index_load(INT64_MAX);
+    }
+
+    find_update_prompt();
+    char* query = editor_prompt(find_prompt, callback);
+    if (query) {
+        free(query);
+    } else {
+        editor_state.cursor_x   = saved_cursor_x;
+        editor_state.cursor_y   = saved_cursor_y;
+        editor_state.col_offset = saved_col_offset;
+        editor_state.row_offset = saved_row_offset;
+    }
+}
+
+/*** pager ***/
+
+// Show the rows the line index has complete so far.
+void pager_sync_rows(void) {
+    // `done` first: once it is set the count is final.
+    bool done = atomic_load(&line_index->done);
+    editor_state.rows_count = atomic_load(&line_index->new_lines) + (done && line_index->partial_last);
+}
+
+// Wait for the line index to reach `lines` lines and the end of the line
+// holding `offset`, and show the rows it has so far.
+void pager_index_until(int64_t lines, int64_t offset) {
+    line_index_wait(lines, offset);
+    pager_sync_rows();
+}
+
+void pager_block_free(Pager_Block* block) {
+    for (int j = 0; j < block->rows_count; j += 1) {
+        row_cache_free(block->caches[j]);
+    }
+    if (block->map_size) munmap(block->map, block->map_size);
+    free(block->rows);
+    free(block->caches);
+    free(block);
+}
+
+// Drop the least recently used blocks until `bytes` more fit in the cache.
+// The block used last is kept whatever the size of the cache: a row of it may
+// still be in use by the caller.
+void pager_evict(int64_t bytes) {
+    while (pager.blocks_count > 0 && pager.cache_bytes + bytes > pager.cache_max) {
+        int oldest = 0;
+        for (int j = 1; j < pager.blocks_count; j += 1) {
+            if (pager.blocks[j]->used_at < pager.blocks[oldest]->used_at) oldest = j;
+        }
+        if (pager.blocks[oldest]->used_at == pager.clock) break;
+
+        pager.cache_bytes -= pager.blocks[oldest]->bytes;
+        pager_block_free(pager.blocks[oldest]);
+        pager.blocks_count         -= 1;
+        pager.blocks[oldest]        = pager.blocks[pager.blocks_count];
+    }
+}
+
+// Free every block of `p`, which may be the pager of an inactive buffer.
+void pager_drop_blocks(Pager* p) {
+    for (int j = 0; j < p->blocks_count; j += 1) {
+        pager_block_free(p->blocks[j]);
+    }
+    p->blocks_count = 0;
+    p->cache_bytes  = 0;
+}
+
+// The block `index` if it is in the cache, NULL otherwise.
+Pager_Block* pager_block_cached(int64_t index) {
+    for (int j = 0; j < pager.blocks_count; j += 1) {
+        if (pager.blocks[j]->index == index) {
+            pager.clock += 1;
+            pager.blocks[j]->used_at = pager.clock;
+            return pager.blocks[j];
+        }
+    }
+
+    return NULL;
+}
+
+// The block `index`, mapped and cut in rows if it isn't in the cache.
+Pager_Block* pager_block(int64_t index) {
+    Pager_Block* block = pager_block_cached(index);
+    if (block != NULL) return block;
+
+    pager_index_until((index + 1) * PAGER_BLOCK_LINES, -1);
+    int64_t offsets_count = atomic_load(&line_index->offsets_count);
+    int64_t start = line_index->offsets[index];
+    int64_t end   = (index + 1 < offsets_count) ? line_index->offsets[index + 1] : pager.file_size;
+
+    int64_t bytes = (end - start) + (sizeof(Editor_Row) + sizeof(Row_Cache*)) * PAGER_BLOCK_LINES;
+    pager_evict(bytes);
+
+    block = calloc(1, sizeof(Pager_Block));
+    if (block == NULL) die("Error while loading a block");
+    block->index      = index;
+    block->map_offset = start / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+    block->map_size   = end - block->map_offset;
+    block->rows       = malloc(sizeof(Editor_Row) * PAGER_BLOCK_LINES);
+    block->caches     = calloc(PAGER_BLOCK_LINES, sizeof(Row_Cache*));
+    block->bytes      = bytes;
+    if (block->rows == NULL || block->caches == NULL) die("Error while loading a block");
+
+    if (block->map_size) {
+        block->map = mmap(NULL, block->map_size, PROT_READ, MAP_PRIVATE, pager.fd, block->map_offset);
+        if (block->map == MAP_FAILED) die("Error while loading a block");
+    }
+
+    char* line = &block->map[start - block->map_offset];
+    char* text_end = &block->map[block->map_size];
+    while (line < text_end && block->rows_count < PAGER_BLOCK_LINES) {
+        char* new_line = memchr(line, '\n', text_end - line);
+        int64_t line_len = (new_line ? new_line : text_end) - line;
+        while (line_len > 0 && line[line_len - 1] == '\r') {
+            line_len -= 1;
+        }
+
+        block->rows[block->rows_count] = (Editor_Row) { .chars = line, .size = line_len };
+        block->rows_count += 1;
+        line = new_line ? new_line + 1 : text_end;
+    }
+
+    pager.blocks = realloc(pager.blocks, sizeof(Pager_Block*) * (pager.blocks_count + 1));
+    if (pager.blocks == NULL) die("Error while loading a block");
+    pager.blocks[pager.blocks_count]  = block;
+    pager.blocks_count               += 1;
+    pager.cache_bytes                += bytes;
+    pager.clock                      += 1;
+    block->used_at                    = pager.clock;
+    return block;
+}
+
+Row_Cache* pager_block_cache(Pager_Block* block, int at) {
+    if (block->caches[at] == NULL) {
+        block->caches[at]  = row_cache_new();
+        block->bytes      += sizeof(Row_Cache);
+        pager.cache_bytes += sizeof(Row_Cache);
+    }
+
+    return block->caches[at];
+}
+
+// Compute the lexer state of the rows of a block up to `at`.
+void pager_block_sync(Pager_Block* block, int at) {
+    while (block->hl_synced <= at) {
+        int j = block->hl_synced;
+        int state = HL_STATE_NORMAL;
+        if (j > 0) {
+            state = editor_row_exit_state(&block->rows[j - 1], block->caches[j - 1], hl_state_bit(block->hl_states, j - 1));
+        }
+
+        hl_state_bit_set(block->hl_states, j, state);
+        block->hl_synced += 1;
+    }
+}
+
+Editor_Row* pager_row_at(int64_t at) {
+    Pager_Block* block = pager_block(at / PAGER_BLOCK_LINES);
+    return &block->rows[at % PAGER_BLOCK_LINES];
+}
+
+Row_Cache* pager_row_cache(int64_t at) {
+    return pager_block_cache(pager_block(at / PAGER_BLOCK_LINES), at % PAGER_BLOCK_LINES);
+}
+
+// Doesn't bring the block of the row back in the cache.
+Row_Cache* pager_row_cache_peek(int64_t at) {
+    Pager_Block* block = pager_block_cached(at / PAGER_BLOCK_LINES);
+    return block ? block->caches[at % PAGER_BLOCK_LINES] : NULL;
+}
+
+Editor_Row* pager_row_rendered(int64_t at, Row_Cache** cache) {
+    Pager_Block* block = pager_block(at / PAGER_BLOCK_LINES);
+    int block_at = at % PAGER_BLOCK_LINES;
+
+    int64_t prof_start = prof_begin();
+    pager_block_sync(block, block_at);
+    prof_end(PROF_SYNTAX, prof_start);
+
+    Editor_Row* row = &block->rows[block_at];
+    *cache = pager_block_cache(block, block_at);
+    int64_t old_size = row_cache_size(*cache);
+    if ((*cache)->render == NULL) editor_update_render(row, *cache);
+    if ((*cache)->hl == NULL) editor_update_syntax(*cache, hl_state_bit(block->hl_states, block_at));
+
+    int64_t grown = row_cache_size(*cache) - old_size;
+    block->bytes      += grown;
+    pager.cache_bytes += grown;
+    return row;
+}
+
+// File offset of the start of the row `at`.
+int64_t pager_row_offset(int64_t at) {
+    Pager_Block* block = pager_block(at / PAGER_BLOCK_LINES);
+    return block->map_offset + (block->rows[at % PAGER_BLOCK_LINES].chars - block->map);
+}
+
+// Row holding the file offset `offset`, `col` receiving its position in it.
+int64_t pager_row_at_offset(int64_t offset, int64_t* col) {
+    pager_index_until(0, offset);
+
+    int64_t lo = 0;
+    int64_t hi = atomic_load(&line_index->offsets_count) - 1;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo + 1) / 2;
+        if (line_index->offsets[mid] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    Pager_Block* block = pager_block(lo);
+    char* at = &block->map[offset - block->map_offset];
+    int row_lo = 0;
+    int row_hi = block->rows_count - 1;
+    while (row_lo < row_hi) {
+        int mid = row_lo + (row_hi - row_lo + 1) / 2;
+        if (block->rows[mid].chars <= at) {
+            row_lo = mid;
+        } else {
+            row_hi = mid - 1;
+        }
+    }
+
+    *col = at - block->rows[row_lo].chars;
+    if (*col > block->rows[row_lo].size) *col = block->rows[row_lo].size;
+    return lo * PAGER_BLOCK_LINES + row_lo;
+}
+
+// Offset of the first occurrence of `query` at or after `from`, or with
+// `backward` of the last one starting before it. The file is read a chunk at
+// a time without being indexed. -1 when there is none, -2 when a key was
+// pressed meanwhile.
+int64_t pager_search(const char* query, int query_len, int64_t from, bool backward) {
+    long page = sysconf(_SC_PAGESIZE);
+
+    while (true) {
+        if (editor_input_pending()) return -2;
+
+        int64_t start, end;
+        if (!backward) {
+            if (from + query_len > pager.file_size) return -1;
+            start = from / page * page;
+            end   = start + PAGER_SCAN_CHUNK;
+            if (end > pager.file_size) end = pager.file_size;
+        } else {
+            if (from <= 0) return -1;
+            // a match starting before `from` ends before this.
+            end = from - 1 + query_len;
+            if (end > pager.file_size) end = pager.file_size;
+            start = end - PAGER_SCAN_CHUNK;
+            if (start < 0) start = 0;
+            start = start / page * page;
+        }
+
+        char* map = mmap(NULL, end - start, PROT_READ, MAP_PRIVATE, pager.fd, start);
+        if (map == MAP_FAILED) die("Error while searching the file");
+        madvise(map, end - start, MADV_SEQUENTIAL);
+
+        const char* match = NULL;
+        if (!backward) {
+            match = find_memmem(&map[from - start], end - from, query, query_len);
+        } else {
+            const char* at = map;
+            const char* found;
+            while ((found = find_memmem(at, &map[end - start] - at, query, query_len)) != NULL && start + (found - map) < from) {
+                match = found;
+                at    = found + 1;
+            }
+        }
+        int64_t match_offset = match ? start + (match - map) : -1;
+        munmap(map, end - start);
+
+        if (match_offset != -1) return match_offset;
+        if (!backward) {
+            if (end == pager.file_size) return -1;
+            from = end - query_len + 1;
+        } else {
+            if (start == 0) return -1;
+            from = start;
+        }
+    }
+}
+
+// Same in the regex mode, a row at a time since a match never spans lines:
+// the rows without the literal of the regex are skipped with find_memmem,
+// the others go through its DFAs.
+int64_t pager_search_regex(int64_t from, bool backward, int64_t* len) {
+    Regex_Matcher* matcher = &find_state.matcher;
+    int64_t col;
+    int64_t at = pager_row_at_offset(from, &col);
+
+    while (true) {
+        if (at >= editor_state.rows_count) {
+            pager_index_until(at + 1, -1);
+            if (at >= editor_state.rows_count) return -1;
+        }
+        if (at % PAGER_BLOCK_LINES == 0 && editor_input_pending()) return -2;
+
+        // forward the first match from `col` on, backward the last before it.
+        Editor_Row* row = pager_row_at(at);
+        int64_t match = -1;
+        if (regex_scan(matcher, row->chars, row->size)) {
+            int64_t pos = 0;
+            int64_t start, end;
+            while (regex_next(matcher, row->chars, row->size, &pos, &start, &end)) {
+                if (backward && start >= col) break;
+                if (!backward && start < col) continue;
+                match = start;
+                *len  = end - start;
+                if (!backward) break;
             }
+        }
+        if (match != -1) return pager_row_offset(at) + match;
+
+        if (!backward) {
+            at  += 1;
+            col  = 0;
         } else {
-            row->render[idx] = row->chars[j];
-            idx += 1;
+            if (at == 0) return -1;
+            at  -= 1;
+            col  = INT64_MAX;
         }
     }
+}
 
-    row->render[idx] = '\0';
-    row->render_size = idx;
+// The match from `from` on, or before it `backward`, its length in `*len`.
+int64_t pager_find(const char* query, int query_len, int64_t from, bool backward, int64_t* len) {
+    if (find_state.regex) return pager_search_regex(from, backward, len);
 
-    editor_update_syntax(row);
+    *len = query_len;
+    return pager_search(query, query_len, from, backward);
 }
 
+// Searching in the pager goes from match to match through the file instead
+// of collecting every match, so that it takes no memory whatever the file.
+// It starts from the cursor rather than the top of the file.
+void pager_find_start(void) {
+    pager.find_from  = 0;
+    pager.find_match = -1;
+    if (editor_state.cursor_y < editor_state.rows_count) {
+        pager.find_from = pager_row_offset(editor_state.cursor_y) + editor_state.cursor_x;
+    }
+}
 
-void editor_insert_row(int at, char* line, size_t line_len) {
-    if (at < 0 || at > editor_state.rows_count) return;
+void pager_find_callback(char* query, int key) {
+    find_restore_highlight();
+    if (key == '\r' || key == '\x1b') {
+        find_drop_regex();
+        return;
+    }
+    if (key == CTRL_KEY('r')) find_toggle_regex();
+
+    int query_len = strlen(query);
+    if (query_len == 0) return;
+    if (find_state.regex && !find_compile(query)) return;
+
+    int64_t match;
+    int64_t len;
+    if (key == MOVE_RIGHT || key == MOVE_DOWN) {
+        int64_t from = (pager.find_match == -1) ? pager.find_from : pager.find_match + 1;
+        match = pager_find(query, query_len, from, false, &len);
+        if (match == -1) match = pager_find(query, query_len, 0, false, &len);
+    } else if (key == MOVE_LEFT || key == MOVE_UP) {
+        int64_t from = (pager.find_match == -1) ? pager.find_from : pager.find_match;
+        match = pager_find(query, query_len, from, true, &len);
+        if (match == -1) match = pager_find(query, query_len, pager.file_size, true, &len);
+    } else {
+        match = pager_find(query, query_len, pager.find_from, false, &len);
+        if (match == -1) match = pager_find(query, query_len, 0, false, &len);
+    }
+    if (match < 0) return;
 
-    editor_state.rows = realloc(editor_state.rows, sizeof(Editor_Row) * (editor_state.rows_count + 1));
-    memmove(&editor_state.rows[at + 1], &editor_state.rows[at], sizeof(Editor_Row) * (editor_state.rows_count - at));
-    for(int j = at + 1; j <= editor_state.rows_count; j += 1) editor_state.rows[j].idx += 1;
+    pager.find_match = match;
+    int64_t col;
+    int64_t row = pager_row_at_offset(match, &col);
+    find_highlight(row, col, len);
+}
 
-    editor_state.rows[at].idx = at;
+// Open `filename` as a pager when it is larger than the memory of the machine
+// or `--pager` was given. It is shown as soon as the line index has the first
+// screens, a search doesn't need the index at all. False for a file that
+// can't be paged (empty, not a regular file...), which is loaded instead.
+bool pager_open(char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat st;
+    int64_t memory = (int64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 || (!pager.enabled && st.st_size < memory)) {
+        close(fd);
+        pager.enabled = false;
+        return false;
+    }
 
-    editor_state.rows[at].size  = line_len;
-    editor_state.rows[at].chars = malloc(line_len + 1);
-    memcpy(editor_state.rows[at].chars, line, line_len);
-    editor_state.rows[at].chars[line_len] = '\0';
+    pager.enabled   = true;
+    pager.fd        = fd;
+    pager.file_size = st.st_size;
+    line_index_start(dup(fd), pager.file_size);
+    pager_index_until(editor_state.screen_rows * 2, -1);
 
-    editor_state.rows[at].render_size     = 0;
-    editor_state.rows[at].render          = NULL;
-    editor_state.rows[at].hl              = NULL;
-    editor_state.rows[at].hl_open_comment = 0;
-    editor_update_row(&editor_state.rows[at]);
+    editor_set_status_msg("Read-only pager | Ctrl-E = end | Ctrl-F = find | Ctrl-Q = quit");
+    return true;
+}
 
-    editor_state.rows_count += 1;
-    editor_state.dirty      += 1;
+/*** buffers ***/
+
+// Files open besides the current one keep their state here while the globals
+// hold the current one's, see `buffer_switch`. The caches of the rows of
+// inactive buffers are dropped, least recently used buffer first, once they
+// hold more than EDITOR_BUFFERS_CACHE_MB together: an inactive buffer costs
+// its rows, which mostly view its mapped file, and its journals.
+#define EDITOR_BUFFERS_CACHE_MB 64
+
+typedef struct Editor_Buffer {
+    Editor_State state;
+    Undo_Journal undo;
+    Swap_Journal swap;
+    Pager        pager;
+    Line_Index*  line_index;
+    Row_Store    row_store;
+    // Memory of the caches of its rows while inactive.
+    int64_t      cache_bytes;
+    int64_t      used_at;
+} Editor_Buffer;
+
+typedef struct Buffer_List {
+    // The slot of the current buffer is only written when switching away
+    // from it.
+    Editor_Buffer* items;
+    int            count;
+    int            current;
+    int64_t        clock;
+    // `--pager` and `--cache` apply to every buffer.
+    Pager          pager_defaults;
+} Buffer_List;
+
+Buffer_List buffers = { 0 };
+
+// Globals of a buffer with no file.
+void buffer_init(void) {
+    editor_state.cursor_x         = 0;
+    editor_state.cursor_y         = 0;
+    editor_state.render_x         = 0;
+    editor_state.row_offset       = 0;
+    editor_state.col_offset       = 0;
+    row_store                     = (Row_Store) { 0 };
+    editor_state.rows             = row_node_new(true);
+    editor_state.rows_count       = 0;
+    editor_state.chars_total      = 0;
+    editor_state.map              = NULL;
+    editor_state.map_size         = 0;
+    editor_state.hl_synced        = 0;
+    editor_state.hl_pending_count = 0;
+    editor_state.dirty            = 0;
+    editor_state.filename         = NULL;
+    editor_state.syntax           = NULL;
+
+    undo       = (Undo_Journal) { .last = -1, .step = -1 };
+    swap       = (Swap_Journal) { .fd = -1 };
+    pager      = buffers.pager_defaults;
+    line_index = line_index_new();
 }
 
-void editor_free_row(Editor_Row* row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+// Make `buffer` current, the terminal and the status message staying as
+// they are.
+void buffer_load(Editor_Buffer* buffer) {
+    Editor_State screen = editor_state;
+
+    editor_state                  = buffer->state;
+    editor_state.screen_rows      = screen.screen_rows;
+    editor_state.screen_cols      = screen.screen_cols;
+    editor_state.status_msg_time  = screen.status_msg_time;
+    editor_state.original_termios = screen.original_termios;
+    memcpy(editor_state.status_msg, screen.status_msg, sizeof(screen.status_msg));
+
+    undo       = buffer->undo;
+    swap       = buffer->swap;
+    pager      = buffer->pager;
+    line_index = buffer->line_index;
+    row_store  = buffer->row_store;
 }
 
-void editor_del_row(int at) {
-    if (at < 0 || at >= editor_state.rows_count) return;
-    editor_free_row(&editor_state.rows[at]);
-    memmove(&editor_state.rows[at], &editor_state.rows[at + 1], sizeof(Editor_Row) * (editor_state.rows_count - at - 1));
-    for(int j = at; j < editor_state.rows_count - 1; j += 1) editor_state.rows[j].idx -= 1;
-    editor_state.rows_count -= 1;
-    editor_state.dirty += 1;
+// Store the globals of the current buffer in its slot before another one
+// gets current. Its search stops, its journal is flushed.
+void buffer_leave(void) {
+    find_reset();
+    swap_flush();
+    // typing after coming back is a step of its own.
+    undo.step = -1;
+
+    Editor_Buffer* buffer = &buffers.items[buffers.current];
+    buffer->state      = editor_state;
+    buffer->undo       = undo;
+    buffer->swap       = swap;
+    buffer->pager      = pager;
+    buffer->line_index = line_index;
+    buffer->row_store  = row_store;
+
+    buffers.clock       += 1;
+    buffer->used_at      = buffers.clock;
+    buffer->cache_bytes  = pager.enabled ? pager.cache_bytes : row_store.cache_bytes;
 }
 
-void editor_row_insert_char(Editor_Row* row, int at, int c) {
-    if(at < 0 || at > row->size) {
-        at = row->size;
+// Drop the caches of the least recently used inactive buffers until they
+// all fit in EDITOR_BUFFERS_CACHE_MB.
+void buffers_evict(void) {
+    int64_t total = 0;
+    for (int j = 0; j < buffers.count; j += 1) {
+        if (j != buffers.current) total += buffers.items[j].cache_bytes;
     }
 
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size += 1;
-    row->chars[at] = c;
-    editor_update_row(row);
-    editor_state.dirty += 1;
-}
+    while (total > (int64_t) EDITOR_BUFFERS_CACHE_MB << 20) {
+        Editor_Buffer* oldest = NULL;
+        for (int j = 0; j < buffers.count; j += 1) {
+            Editor_Buffer* buffer = &buffers.items[j];
+            if (j == buffers.current || buffer->cache_bytes == 0) continue;
+            if (oldest == NULL || buffer->used_at < oldest->used_at) oldest = buffer;
+        }
 
-void editor_row_append_string(Editor_Row* row, char* s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editor_update_row(row);
-    editor_state.dirty += 1;
+        // the caches go back to the store of their own buffer.
+        Row_Store current_store = row_store;
+        row_store = oldest->row_store;
+        if (oldest->pager.enabled) {
+            pager_drop_blocks(&oldest->pager);
+        } else {
+            row_tree_drop_caches(oldest->state.rows);
+        }
+        oldest->row_store = row_store;
+        row_store         = current_store;
+        total               -= oldest->cache_bytes;
+        oldest->cache_bytes  = 0;
+    }
 }
 
-void editor_row_del_char(Editor_Row* row, int at) {
-    if(at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size -= 1;
-    editor_update_row(row);
-    editor_state.dirty += 1;
+// Add a buffer with no file and make it current.
+void buffer_add(void) {
+    if (buffers.count > 0) buffer_leave();
+
+    buffers.items = realloc(buffers.items, sizeof(Editor_Buffer) * (buffers.count + 1));
+    if (buffers.items == NULL) die("Error while adding a buffer");
+    buffers.current  = buffers.count;
+    buffers.count   += 1;
+    buffer_init();
 }
 
-/*** editor operations ***/
+void buffer_show_status(void) {
+    editor_set_status_msg("%s [%d/%d]", editor_state.filename ? editor_state.filename : "[No Name]", buffers.current + 1, buffers.count);
+}
 
-void editor_insert_char(int c) {
-    if(editor_state.cursor_y == editor_state.rows_count) {
-        editor_insert_row(editor_state.rows_count, "", 0);
-    }
+void buffer_switch(int at) {
+    if (at == buffers.current) return;
 
-    editor_row_insert_char(&editor_state.rows[editor_state.cursor_y], editor_state.cursor_x, c);
-    editor_state.cursor_x += 1;
+    buffer_leave();
+    buffers.current = at;
+    buffer_load(&buffers.items[at]);
+    buffers_evict();
+    buffer_show_status();
 }
 
-void editor_insert_new_line(void) {
-    if (editor_state.cursor_x == 0) {
-        editor_insert_row(editor_state.cursor_y, "", 0);
-    } else {
-        Editor_Row* row = &editor_state.rows[editor_state.cursor_y];
-        editor_insert_row(editor_state.cursor_y + 1, &row->chars[editor_state.cursor_x], row->size - editor_state.cursor_x);
-        row = &editor_state.rows[editor_state.cursor_y];
-        row->size = editor_state.cursor_x;
-        row->chars[row->size] = '\0';
-        editor_update_row(row);
+// Open `filename` in a new buffer, or switch to the buffer that has it open
+// already.
+void buffer_open(char* filename) {
+    for (int j = 0; j < buffers.count; j += 1) {
+        char* open_filename = (j == buffers.current) ? editor_state.filename : buffers.items[j].state.filename;
+        if (open_filename && !strcmp(open_filename, filename)) {
+            buffer_switch(j);
+            return;
+        }
     }
 
-    editor_state.cursor_y += 1;
-    editor_state.cursor_x  = 0;
+    if (access(filename, R_OK) == -1) {
+        editor_set_status_msg("Can't open %s: %s", filename, strerror(errno));
+        return;
+    }
+
+    buffer_add();
+    editor_open(filename);
+    buffers_evict();
+    if (editor_state.status_msg[0] == '\0') buffer_show_status();
 }
 
-void editor_del_char(void) {
-    if (editor_state.cursor_y == editor_state.rows_count) return;
-    if (editor_state.cursor_x == 0 && editor_state.cursor_y == 0) return;
+// Free the current buffer and switch to the one used last, unless it is the
+// only one.
+void buffer_close(void) {
+    if (buffers.count == 1) return;
+
+    find_reset();
+    swap_discard();
+    free(swap.path);
+    free(swap.b);
+    free(undo.b);
+    line_index_free(line_index);
+
+    if (pager.enabled) {
+        pager_drop_blocks(&pager);
+        free(pager.blocks);
+        close(pager.fd);
+    }
+    // the tree, its rows and their caches all live in the store.
+    row_store_release(&row_store);
+    if (editor_state.map) munmap(editor_state.map, editor_state.map_size);
+    free(editor_state.filename);
 
+    buffers.count -= 1;
+    memmove(&buffers.items[buffers.current], &buffers.items[buffers.current + 1], sizeof(Editor_Buffer) * (buffers.count - buffers.current));
 
-    Editor_Row* row = &editor_state.rows[editor_state.cursor_y];
-    if (editor_state.cursor_x > 0) {
-        editor_row_del_char(row, editor_state.cursor_x - 1);
-        editor_state.cursor_x -= 1;
-    } else {
-        editor_state.cursor_x = editor_state.rows[editor_state.cursor_y - 1].size;
-        editor_row_append_string(&editor_state.rows[editor_state.cursor_y - 1], row->chars, row->size);
-        editor_del_row(editor_state.cursor_y);
-        editor_state.cursor_y -= 1;
+    int last = 0;
+    for (int j = 1; j < buffers.count; j += 1) {
+        if (buffers.items[j].used_at > buffers.items[last].used_at) last = j;
     }
+    buffers.current = last;
+    buffer_load(&buffers.items[last]);
+    buffer_show_status();
 }
 
-/*** file i/o ***/
-
-char* editor_rows_to_string(int* buf_len) {
-    int total_len = 0;
-    for (int j = 0; j < editor_state.rows_count; j += 1) {
-        total_len += editor_state.rows[j].size + 1;
-    }
-    *buf_len = total_len;
+// Remove the swap file of every buffer, which are all closed at once.
+void buffers_discard_swaps(void) {
+    swap_discard();
+    for (int j = 0; j < buffers.count; j += 1) {
+        Swap_Journal* journal = &buffers.items[j].swap;
+        if (j == buffers.current || journal->fd == -1) continue;
 
-    char* buf = malloc(total_len);
-    char *p = buf;
-    for (int j = 0; j < editor_state.rows_count; j += 1) {
-        memcpy(p, editor_state.rows[j].chars, editor_state.rows[j].size);
-        p += editor_state.rows[j].size;
-        *p = '\n';
-        p += 1;
+        close(journal->fd);
+        unlink(journal->path);
+        journal->fd = -1;
     }
-
-    return buf;
 }
 
-void editor_open(char* filename) {
-    free(editor_state.filename);
-    editor_state.filename = strdup(filename);
+/*** append buffer ***/
 
-    editor_select_syntax_highlight();
+// The capacity grows geometrically and is kept when the buffer is emptied
+// with `append_buf_reset`, so a buffer reused across frames stops allocating.
+typedef struct Append_Buf {
+    char*   b;
+    int64_t len;
+    int64_t cap;
+} Append_Buf;
 
-    FILE* fp = fopen(filename, "r");
-    if (!fp) die("Error while opening the file");
+#define APPEND_BUF_INIT { .b = NULL, .len = 0, .cap = 0 }
 
-    char* line       = NULL;
-    size_t line_cap  = 0;
-    ssize_t line_len;
+void append_buf_append(Append_Buf* buf, const char* s, int64_t len) {
+    if (buf->len + len > buf->cap) {
+        int64_t cap = buf->cap ? buf->cap : 1024;
+        while (cap < buf->len + len) cap *= 2;
 
-    while((line_len = getline(&line, &line_cap, fp)) != -1) {
-        while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
-            line_len -= 1;
-        }
+        char *new = realloc(buf->b, cap);
+        prof_count(PROF_ALLOCS, 1);
+        if (new == NULL) return;
 
-        editor_insert_row(editor_state.rows_count, line, line_len);
+        buf->b   = new;
+        buf->cap = cap;
     }
 
-    free(line);
-    fclose(fp);
-    editor_state.dirty = 0;
+    memcpy(&buf->b[buf->len], s, len);
+    buf->len += len;
 }
 
-void editor_save(void) {
-    if (editor_state.filename == NULL) {
-        editor_state.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
-        if (editor_state.filename == NULL) {
-            editor_set_status_msg("Save aborted");
-            return;
-        }
+void append_buf_reset(Append_Buf* buf) {
+    buf->len = 0;
+}
 
-        editor_select_syntax_highlight();
-    }
+void append_buf_free(Append_Buf* buf) {
+    free(buf->b);
+}
 
-    int len;
-    char* buf = editor_rows_to_string(&len);
+/*** frame ***/
 
-    int fd = open(editor_state.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if(ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                editor_state.dirty = 0;
-                editor_set_status_msg("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+// The screen is drawn into a grid of cells and only the cells that differ
+// from the previous frame (the shadow, mirroring what the terminal shows) are
+// sent to the terminal. Characters and attributes are kept in separate
+// arrays so that a run of cells sharing an attribute goes out in one copy.
+//
+// An attribute is the highlight class of the cell, with CELL_REVERSE for
+// reverse video.
+#define CELL_REVERSE 0x80
+
+// Changed cells separated by fewer unchanged ones than this are sent in one
+// run, a cursor move costing about as much.
+#define FRAME_GAP_MAX 4
+
+typedef struct Frame {
+    int            rows;
+    int            cols;
+    char*          chars;
+    unsigned char* attrs;
+    char*          shadow_chars;
+    unsigned char* shadow_attrs;
+    bool           shadow_valid;
+    // Row offset the shadow was drawn at, to scroll it instead of redrawing.
+    int64_t        row_offset;
+    // Output of the frame, reused from one frame to the next.
+    Append_Buf     out;
+    // When the last frame was drawn, and whether one was held back since.
+    long           drawn_at;
+    bool           pending;
+    // Frames drawn a second at most.
+    int            fps_max;
+} Frame;
+
+Frame frame = { .fps_max = EDITOR_FPS_MAX };
+
+// SGR sequence selecting each attribute, built once.
+char attr_escapes[256][16];
+int  attr_escapes_len[256];
+
+void frame_build_escapes(void) {
+    for (int attr = 0; attr < 256; attr += 1) {
+        int hl = attr & ~CELL_REVERSE;
+        attr_escapes_len[attr] = snprintf(
+            attr_escapes[attr],
+            sizeof(attr_escapes[attr]),
+            (attr & CELL_REVERSE) ? "\x1b[0;7;%dm" : "\x1b[0;%dm",
+            hl == HL_NORMAL ? 39 : editor_syntax_to_color(hl)
+        );
     }
+}
 
-    free(buf);
-    editor_set_status_msg("Can't save! I/O error: %s", strerror(errno));
+void frame_resize(int rows, int cols) {
+    if (frame.rows == rows && frame.cols == cols) return;
+    if (frame.chars == NULL) frame_build_escapes();
+
+    free(frame.chars);
+    free(frame.attrs);
+    free(frame.shadow_chars);
+    free(frame.shadow_attrs);
+    frame.rows         = rows;
+    frame.cols         = cols;
+    frame.chars        = malloc(rows * cols);
+    frame.attrs        = malloc(rows * cols);
+    frame.shadow_chars = malloc(rows * cols);
+    frame.shadow_attrs = malloc(rows * cols);
+    frame.shadow_valid = false;
+    if (frame.chars == NULL || frame.attrs == NULL || frame.shadow_chars == NULL || frame.shadow_attrs == NULL) {
+        die("Error while allocating the frame");
+    }
 }
 
-/*** find ***/
+void frame_clear_rows(char* chars, unsigned char* attrs, int from, int to) {
+    memset(&chars[from * frame.cols], ' ', (to - from) * frame.cols);
+    memset(&attrs[from * frame.cols], HL_NORMAL, (to - from) * frame.cols);
+}
 
-void editor_find_callback(char* query, int key) {
-    static int last_match_row = -1;
-    static int direction      = 1;
+void frame_clear_row(int y) {
+    frame_clear_rows(frame.chars, frame.attrs, y, y + 1);
+}
 
-    static int saved_hl_line;
-    static char* saved_hl = NULL;
+// Write `len` bytes at (`y`, `x`), clipped to the frame width.
+void frame_put(int y, int x, const char* s, int len, unsigned char attr) {
+    if (x + len > frame.cols) len = frame.cols - x;
+    if (len <= 0) return;
 
-    if (saved_hl) {
-        memcpy(editor_state.rows[saved_hl_line].hl, saved_hl, editor_state.rows[saved_hl_line].render_size);
-        free(saved_hl);
-        saved_hl = NULL;
-    }
+    memcpy(&frame.chars[y * frame.cols + x], s, len);
+    memset(&frame.attrs[y * frame.cols + x], attr, len);
+}
 
-    if (key == '\r' || key == '\x1b') {
-        last_match_row = -1;
-        direction  = 1;
-        return;
-    } else if(key == MOVE_RIGHT || key == MOVE_DOWN) {
-        direction  = 1;
-    } else if(key == MOVE_LEFT || key == MOVE_UP) {
-        direction  = -1;
-    } else {
-        last_match_row = -1;
-        direction  = 1;
-    }
-
-    if (last_match_row == -1) direction = 1;
-    int curr_match_row = last_match_row;
-    for (int i = 0; i < editor_state.rows_count;  i += 1) {
-        curr_match_row += direction;
-        if (curr_match_row  == -1) curr_match_row = editor_state.rows_count - 1;
-        else if (curr_match_row == editor_state.rows_count) curr_match_row = 0; 
-
-        Editor_Row* row = &editor_state.rows[curr_match_row];
-        char* match = strstr(row->render, query);
-        if (match) {
-            last_match_row = curr_match_row;
-            editor_state.cursor_y = curr_match_row;
-            editor_state.cursor_x = editor_row_render_x_to_cursor_x(row, match - row->render);
-            editor_state.row_offset = editor_state.rows_count;
-
-            saved_hl_line = curr_match_row;
-            saved_hl = malloc(row->render_size);
-            memcpy(saved_hl, row->hl, row->render_size);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
-    }
+void frame_move_cursor(Append_Buf* buf, int y, int x) {
+    char move_buf[32];
+    int move_len = snprintf(move_buf, sizeof(move_buf), "\x1b[%d;%dH", y + 1, x + 1);
+    append_buf_append(buf, move_buf, move_len);
 }
 
-void editor_find(void) {
-    int saved_cursor_x   = editor_state.cursor_x;
-    int saved_cursor_y   = editor_state.cursor_y;
-    int saved_col_offset = editor_state.col_offset;
-    int saved_row_offset = editor_state.row_offset;
+// Scroll the text rows of the terminal, and of the shadow along with it, when
+// the view moved by less than a screen since the previous frame.
+void frame_scroll(Append_Buf* buf, int text_rows) {
+    int64_t offset_delta = editor_state.row_offset - frame.row_offset;
+    frame.row_offset = editor_state.row_offset;
+    if (offset_delta == 0 || offset_delta >= text_rows || -offset_delta >= text_rows) return;
+    int delta = offset_delta;
+
+    char scroll_buf[32];
+    int scroll_len = snprintf(
+        scroll_buf,
+        sizeof(scroll_buf),
+        "\x1b[1;%dr\x1b[%d%c\x1b[r",
+        text_rows,
+        delta > 0 ? delta : -delta,
+        delta > 0 ? 'S' : 'T'
+    );
+    append_buf_append(buf, scroll_buf, scroll_len);
 
-    char* query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback);
-    if (query) {
-        free(query);
+    int moved = text_rows - (delta > 0 ? delta : -delta);
+    if (delta > 0) {
+        memmove(frame.shadow_chars, &frame.shadow_chars[delta * frame.cols], moved * frame.cols);
+        memmove(frame.shadow_attrs, &frame.shadow_attrs[delta * frame.cols], moved * frame.cols);
+        frame_clear_rows(frame.shadow_chars, frame.shadow_attrs, moved, text_rows);
     } else {
-        editor_state.cursor_x   = saved_cursor_x;
-        editor_state.cursor_y   = saved_cursor_y;
-        editor_state.col_offset = saved_col_offset;
-        editor_state.row_offset = saved_row_offset;
+        memmove(&frame.shadow_chars[-delta * frame.cols], frame.shadow_chars, moved * frame.cols);
+        memmove(&frame.shadow_attrs[-delta * frame.cols], frame.shadow_attrs, moved * frame.cols);
+        frame_clear_rows(frame.shadow_chars, frame.shadow_attrs, 0, -delta);
     }
 }
 
-/*** append buffer ***/
+// Send the difference between the frame and the shadow.
+void frame_flush(Append_Buf* buf, int text_rows) {
+    if (!frame.shadow_valid) {
+        // clear the entire screen.
+        append_buf_append(buf, "\x1b[H\x1b[2J", 7);
+        frame_clear_rows(frame.shadow_chars, frame.shadow_attrs, 0, frame.rows);
+        frame.shadow_valid = true;
+        frame.row_offset   = editor_state.row_offset;
+    } else {
+        frame_scroll(buf, text_rows);
+    }
 
-typedef struct Append_Buf {
-    char* b;
-    int len;
-} Append_Buf;
+    int cursor_y = -1, cursor_x = -1;
+    unsigned char attr = HL_NORMAL;
 
-#define APPEND_BUF_INIT { .b = NULL, .len = 0 }
+    for (int y = 0; y < frame.rows; y += 1) {
+        char* chars                 = &frame.chars[y * frame.cols];
+        unsigned char* attrs        = &frame.attrs[y * frame.cols];
+        char* shadow_chars          = &frame.shadow_chars[y * frame.cols];
+        unsigned char* shadow_attrs = &frame.shadow_attrs[y * frame.cols];
+        if (!memcmp(chars, shadow_chars, frame.cols) && !memcmp(attrs, shadow_attrs, frame.cols)) continue;
 
-void append_buf_append(Append_Buf* buf, const char* s, int len) {
-    char *new = realloc(buf->b, buf->len + len);
+        // Past the last non-blank cell the line is cleared instead.
+        int end = frame.cols;
+        while (end > 0 && chars[end - 1] == ' ' && attrs[end - 1] == HL_NORMAL) end -= 1;
 
-    if (new == NULL) return;
+        int x = 0;
+        while (x < frame.cols) {
+            if (chars[x] == shadow_chars[x] && attrs[x] == shadow_attrs[x]) {
+                x += 1;
+                continue;
+            }
 
-    memcpy(&new[buf->len], s, len);
-    buf->b    = new;
-    buf->len += len;
-}
+            if (cursor_y != y || cursor_x != x) frame_move_cursor(buf, y, x);
+            cursor_y = y;
 
-void append_buf_free(Append_Buf* buf) {
-    free(buf->b);
+            if (x >= end) {
+                if (attr != HL_NORMAL) append_buf_append(buf, attr_escapes[HL_NORMAL], attr_escapes_len[HL_NORMAL]);
+                attr = HL_NORMAL;
+                // clear the rest of the line.
+                append_buf_append(buf, "\x1b[K", 3);
+                cursor_x = x;
+                break;
+            }
+
+            int run_end = x + 1;
+            for (int k = x + 1; k < end && k - run_end < FRAME_GAP_MAX; k += 1) {
+                if (chars[k] != shadow_chars[k] || attrs[k] != shadow_attrs[k]) run_end = k + 1;
+            }
+
+            // Send the run in spans of cells sharing an attribute.
+            while (x < run_end) {
+                int span_end = x + 1;
+                while (span_end < run_end && attrs[span_end] == attrs[x]) span_end += 1;
+
+                if (attrs[x] != attr) {
+                    attr = attrs[x];
+                    append_buf_append(buf, attr_escapes[attr], attr_escapes_len[attr]);
+                }
+                append_buf_append(buf, &chars[x], span_end - x);
+                x = span_end;
+            }
+            // The cursor stays on the last column after writing to it.
+            cursor_x = (x < frame.cols) ? x : -1;
+        }
+    }
+
+    if (attr != HL_NORMAL) append_buf_append(buf, "\x1b[m", 3);
+    memcpy(frame.shadow_chars, frame.chars, frame.rows * frame.cols);
+    memcpy(frame.shadow_attrs, frame.attrs, frame.rows * frame.cols);
 }
 
 /*** output ***/
 
+
 void editor_scroll(void) {
     editor_state.render_x = 0;
     if(editor_state.cursor_y < editor_state.rows_count) {
-        editor_state.render_x = editor_row_cursor_x_to_render_x(&editor_state.rows[editor_state.cursor_y], editor_state.cursor_x);
+        editor_state.render_x = editor_row_cursor_x_to_render_x(
+            editor_row_at(editor_state.cursor_y),
+            editor_row_cache(editor_state.cursor_y),
+            editor_state.cursor_x
+        );
     }
 
     if (editor_state.cursor_y < editor_state.row_offset) {
@@ -805,9 +5601,15 @@ void editor_scroll(void) {
     }
 }
 
-void editor_draw_rows(Append_Buf* buf) {
+void editor_draw_rows(void) {
+    int64_t prof_start = prof_begin();
+    editor_syntax_sync(editor_state.row_offset + editor_state.screen_rows + EDITOR_HL_MARGIN);
+    prof_end(PROF_SYNTAX, prof_start);
+
     for(int y = 0; y < editor_state.screen_rows; y++) {
-        int file_row = y + editor_state.row_offset;
+        frame_clear_row(y);
+
+        int64_t file_row = y + editor_state.row_offset;
         if (file_row >= editor_state.rows_count) {
             if(editor_state.rows_count == 0 && y == editor_state.screen_rows / 3) {
                 char welcome[80];
@@ -819,86 +5621,77 @@ void editor_draw_rows(Append_Buf* buf) {
 
                 int padding = (editor_state.screen_cols - welcome_len) / 2;
                 if (padding) {
-                    append_buf_append(buf, "~", 1);
-                }
-
-                while (padding -= 1) {
-                    append_buf_append(buf, " ", 1);
+                    frame_put(y, 0, "~", 1, HL_NORMAL);
                 }
 
-                append_buf_append(buf, welcome, welcome_len);
+                frame_put(y, padding, welcome, welcome_len, HL_NORMAL);
             }
             else {
-                append_buf_append(buf, "~", 1);
+                frame_put(y, 0, "~", 1, HL_NORMAL);
             }
         } else {
-            int len = editor_state.rows[file_row].render_size - editor_state.col_offset;
+            Row_Cache* cache;
+            editor_row_rendered(file_row, &cache);
+            int64_t len = cache->render_size - editor_state.col_offset;
             if(len < 0) len = 0;
             if (len > editor_state.screen_cols) len = editor_state.screen_cols;
-            char* c  = &editor_state.rows[file_row].render[editor_state.col_offset];
-            unsigned char* hl = &editor_state.rows[file_row].hl[editor_state.col_offset];
-            int current_color = -1;
-
+            char* c  = &cache->render[editor_state.col_offset];
+            unsigned char* hl = &cache->hl[editor_state.col_offset];
+
+            // The row goes in as a whole, control characters being patched
+            // afterwards to show reversed.
+            char* chars = &frame.chars[y * frame.cols];
+            unsigned char* attrs = &frame.attrs[y * frame.cols];
+            memcpy(chars, c, len);
+            memcpy(attrs, hl, len);
             for(int j = 0; j < len; j += 1) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    append_buf_append(buf, "\x1b[7m", 4);
-                    append_buf_append(buf, &sym, 1);
-                    append_buf_append(buf, "\x1b[m", 3);
-                    if(current_color != -1) {
-                        char color_buf[16];
-                        int color_len = snprintf(color_buf, sizeof(color_buf), "\x1b[%dm", current_color);
-                        append_buf_append(buf, color_buf, color_len);
-                    }
-                } else if(hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        append_buf_append(buf, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    append_buf_append(buf, &c[j], 1);
-                } else {
-                    int color = editor_syntax_to_color(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char color_buf[16];
-                        int color_len = snprintf(color_buf, sizeof(color_buf), "\x1b[%dm", color);
-                        append_buf_append(buf, color_buf, color_len);
-                    }
-                    append_buf_append(buf, &c[j], 1);
+                if (iscntrl(chars[j])) {
+                    chars[j]  = (chars[j] <= 26) ? '@' + chars[j] : '?';
+                    attrs[j] |= CELL_REVERSE;
                 }
             }
-
-            append_buf_append(buf, "\x1b[39m", 5);
         }
-
-        // clear the current line.
-        append_buf_append(buf, "\x1b[K", 3);
-        append_buf_append(buf, "\r\n", 2);
     }
 }
 
-void editor_draw_status_bar(Append_Buf* buf) {
-    append_buf_append(buf, "\x1b[7m", 4);
+void editor_draw_status_bar(void) {
+    int y = editor_state.screen_rows;
+    frame_clear_row(y);
 
     char status[80], right_status[80];
 
+    char buffer_at[32] = "";
+    if (buffers.count > 1) snprintf(buffer_at, sizeof(buffer_at), "[%d/%d] ", buffers.current + 1, buffers.count);
+
+    char loading[16] = "";
+    if (!line_index_done()) snprintf(loading, sizeof(loading), " (%d%%)", line_index_progress());
+
     int len = snprintf(
         status,
         sizeof(status),
-        "%.20s - %d lines %s",
+        "%s%.20s - %" PRId64 "%s lines%s %s",
+        buffer_at,
         editor_state.filename ? editor_state.filename : "[No Name]",
         editor_state.rows_count,
+        line_index_done() ? "" : "+",
+        loading,
         editor_state.dirty ? "(modified)" : ""
     );
     if(len > editor_state.screen_cols) {
         len = editor_state.screen_cols;
     }
-    append_buf_append(buf, status, len);
+    frame_put(y, 0, status, len, HL_NORMAL | CELL_REVERSE);
+
+    char find_status[32] = "";
+    if (find_state.query != NULL) {
+        snprintf(find_status, sizeof(find_status), "match %d/%" PRId64 " | ", find_state.current + 1, find_state.total);
+    }
 
     int right_len = snprintf(
         right_status,
         sizeof(right_status),
-        "%s | %d/%d",
+        "%s%s | %" PRId64 "/%" PRId64,
+        find_status,
         editor_state.syntax ? editor_state.syntax->file_type : "no ft",
         editor_state.cursor_y + 1,
         editor_state.rows_count
@@ -906,63 +5699,85 @@ void editor_draw_status_bar(Append_Buf* buf) {
 
     while(len < editor_state.screen_cols) {
         if(editor_state.screen_cols - len == right_len) {
-            append_buf_append(buf, right_status, right_len);
+            frame_put(y, len, right_status, right_len, HL_NORMAL | CELL_REVERSE);
             break;
         } else {
-            append_buf_append(buf, " ", 1);
+            frame_put(y, len, " ", 1, HL_NORMAL | CELL_REVERSE);
             len += 1;
         }
     }
-    append_buf_append(buf, "\x1b[m", 3);
-    append_buf_append(buf, "\r\n", 2);
 }
 
-void editor_draw_msg_bar(Append_Buf* buf) {
-    append_buf_append(buf, "\x1b[K", 3);
+void editor_draw_msg_bar(void) {
+    int y = editor_state.screen_rows + 1;
+    frame_clear_row(y);
+
     int msg_len = strlen(editor_state.status_msg);
     
     if(msg_len > editor_state.screen_cols) {
         msg_len = editor_state.screen_cols;
     }
 
-    if(msg_len && time(NULL) - editor_state.status_msg_time < 5) {
-        append_buf_append(buf, editor_state.status_msg, msg_len);
+    if(msg_len && editor_now_ms() - editor_state.status_msg_time < EDITOR_MSG_MS) {
+        frame_put(y, 0, editor_state.status_msg, msg_len, HL_NORMAL);
+    }
+
+    // Timings of the previous frame, over the right end of the message.
+    if (prof.overlay) {
+        char overlay[128];
+        int overlay_len = snprintf(overlay, sizeof(overlay),
+            "read %" PRId64 " key %" PRId64 " syn %" PRId64 " draw %" PRId64 " write %" PRId64 " load %" PRId64 " us | %" PRId64 " allocs | %" PRId64 " B",
+            prof.last_time[PROF_READ_KEY], prof.last_time[PROF_KEY], prof.last_time[PROF_SYNTAX],
+            prof.last_time[PROF_DRAW_ROWS], prof.last_time[PROF_WRITE], prof.last_time[PROF_LOAD],
+            prof.last_counters[PROF_ALLOCS], prof.last_counters[PROF_BYTES_WRITTEN]);
+        if (overlay_len > editor_state.screen_cols) overlay_len = editor_state.screen_cols;
+        frame_put(y, editor_state.screen_cols - overlay_len, overlay, overlay_len, HL_NORMAL);
     }
 }
 
 void editor_refresh_screen(void) {
+    prof_key_end();
+
+    // The view follows the cursor even for frames that are not drawn.
     editor_scroll();
 
-    Append_Buf buf = APPEND_BUF_INIT;
+    // A frame asked for too soon after the previous one is left to the event
+    // loop, which draws it once it is due.
+    long now = editor_now_ms();
+    if (now - frame.drawn_at < 1000 / frame.fps_max && !replay.enabled) {
+        frame.pending = true;
+        return;
+    }
+    frame.drawn_at = now;
+    frame.pending  = false;
+
+    frame_resize(editor_state.screen_rows + 2, editor_state.screen_cols);
+
+    int64_t prof_start = prof_begin();
+    editor_draw_rows();
+    prof_end(PROF_DRAW_ROWS, prof_start);
+    editor_draw_status_bar();
+    editor_draw_msg_bar();
+
+    Append_Buf* buf = &frame.out;
+    append_buf_reset(buf);
     
     // hide the cursor
-    append_buf_append(&buf, "\x1b[?25l", 6);
+    append_buf_append(buf, "\x1b[?25l", 6);
 
-    // clear the entire screen, not used because each line is cleared in editor_draw_rows.
-    // append_buf_append(&buf, "\x1b[2J", 4);
+    frame_flush(buf, editor_state.screen_rows);
 
-    // move the cursor to the top-left corner.
-    append_buf_append(&buf, "\x1b[H", 3);
-
-    editor_draw_rows(&buf);
-    editor_draw_status_bar(&buf);
-    editor_draw_msg_bar(&buf);
-
-    char cursor_buf[32];
-    snprintf(
-        cursor_buf,
-        sizeof(cursor_buf),
-        "\x1b[%d;%dH",
-        (editor_state.cursor_y - editor_state.row_offset) + 1,
-        (editor_state.render_x - editor_state.col_offset) + 1
-    );
-    append_buf_append(&buf, cursor_buf, strlen(cursor_buf));
+    frame_move_cursor(buf, editor_state.cursor_y - editor_state.row_offset, editor_state.render_x - editor_state.col_offset);
 
     // show the cursor
-    append_buf_append(&buf, "\x1b[?25h", 6);
-
-    write(STDOUT_FILENO, buf.b, buf.len);
-    append_buf_free(&buf);
+    append_buf_append(buf, "\x1b[?25h", 6);
+
+    prof_start = prof_begin();
+    write(STDOUT_FILENO, buf->b, buf->len);
+    prof_end(PROF_WRITE, prof_start);
+    prof_count(PROF_BYTES_WRITTEN, buf->len);
+    prof_frame_end();
+    if (replay.enabled) replay_samples_push(&replay.frame_bytes, buf->len);
 }
 
 void editor_set_status_msg(const char* fmt, ...) {
@@ -970,11 +5785,117 @@ void editor_set_status_msg(const char* fmt, ...) {
     va_start(ap, fmt);
     vsnprintf(editor_state.status_msg, sizeof(editor_state.status_msg), fmt, ap);
     va_end(ap);
-    editor_state.status_msg_time = time(NULL);
+    editor_state.status_msg_time = editor_now_ms();
 }
 
 /*** input ***/
 
+// Smallest of two poll() timeouts, -1 meaning none.
+int editor_timeout_min(int a, int b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    return a < b ? a : b;
+}
+
+// Sleep in poll() until a key can be read, handling meanwhile whatever else
+// wakes the editor: a resize, search workers, the status message expiring, a
+// frame held back by the frame rate cap, a swap batch coming due. Deferred highlighting runs in slices
+// while nothing else happens. With none of these pending the editor uses no
+// CPU at all.
+void editor_wait_input(void) {
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO,        .events = POLLIN },
+        { .fd = editor_wake_pipe[0], .events = POLLIN },
+    };
+
+    while (true) {
+        if (editor_resized) {
+            editor_resized = 0;
+            if (get_window_size(&editor_state.screen_rows, &editor_state.screen_cols)) {
+                editor_state.screen_rows -= 2;
+            }
+            editor_refresh_screen();
+        }
+
+        if (find_idle()) editor_refresh_screen();
+        if (line_index_idle()) editor_refresh_screen();
+
+        long now = editor_now_ms();
+        int timeout = -1;
+
+        if (editor_state.status_msg[0] != '\0') {
+            long expires_in = editor_state.status_msg_time + EDITOR_MSG_MS - now;
+            if (expires_in <= 0) {
+                editor_state.status_msg[0] = '\0';
+                editor_refresh_screen();
+            } else {
+                timeout = expires_in;
+            }
+        }
+
+        if (frame.pending) {
+            long due_in = frame.drawn_at + 1000 / frame.fps_max - now;
+            if (due_in <= 0) {
+                editor_refresh_screen();
+            } else {
+                timeout = editor_timeout_min(timeout, due_in);
+            }
+        }
+
+        if (find_running()) timeout = editor_timeout_min(timeout, EDITOR_FIND_PROGRESS_MS);
+
+        int swap_due_in_ms = swap_due_in();
+        if (swap_due_in_ms == 0) {
+            swap_flush();
+        } else {
+            timeout = editor_timeout_min(timeout, swap_due_in_ms);
+        }
+
+        if (editor_state.hl_pending_count > 0) timeout = 0;
+        // the next block is loaded as soon as it is indexed, a refresh of the
+        // progress is due as long as the index runs.
+        if (line_index->loading && (atomic_load(&line_index->done) || atomic_load(&line_index->offsets_count) > line_index->blocks_loaded + 1)) {
+            timeout = 0;
+        }
+        if (line_index->running) timeout = editor_timeout_min(timeout, EDITOR_LOAD_PROGRESS_MS);
+
+        int ready = poll(fds, 2, timeout);
+        if (ready == -1 && errno != EINTR) {
+            die("Error while waiting for input");
+        }
+
+        if (ready > 0 && fds[0].revents) return;
+        if (ready > 0 && fds[1].revents) editor_wake_drain();
+        if (ready == 0 && editor_state.hl_pending_count > 0) {
+            int64_t prof_start = prof_begin();
+            editor_syntax_step(INT64_MAX, EDITOR_HL_SLICE);
+            prof_end(PROF_SYNTAX, prof_start);
+        }
+    }
+}
+
+// Read the text of a bracketed paste up to its end marker.
+void editor_read_paste(Append_Buf* text) {
+    const char* paste_end = "\x1b[201~";
+    int paste_end_len     = 6;
+
+    int matched = 0;
+    char c;
+
+    while (matched < paste_end_len) {
+        if (!editor_read_byte(&c)) continue;
+
+        if (c == paste_end[matched]) {
+            matched += 1;
+        } else {
+            // what looked like the end marker was text after all.
+            append_buf_append(text, paste_end, matched);
+            matched = (c == paste_end[0]);
+            if (!matched) append_buf_append(text, &c, 1);
+        }
+    }
+}
+
 char* editor_prompt(char* prompt, void (*callback)(char*, int)) {
     size_t buf_cap = 128;
     char* buf = malloc(buf_cap);
@@ -1002,6 +5923,21 @@ char* editor_prompt(char* prompt, void (*callback)(char*, int)) {
                 if (callback) callback(buf, c);
                 return buf;
             }
+        } else if (c == PASTE_START) {
+            // only the printable part of a paste goes in the prompt.
+            Append_Buf text = APPEND_BUF_INIT;
+            editor_read_paste(&text);
+            for (int i = 0; i < text.len; i += 1) {
+                if (iscntrl(text.b[i])) continue;
+                if (buf_len == buf_cap - 1) {
+                    buf_cap *= 2;
+                    buf = realloc(buf, buf_cap);
+                }
+                buf[buf_len]  = text.b[i];
+                buf_len      += 1;
+            }
+            buf[buf_len] = '\0';
+            append_buf_free(&text);
         } else if (!iscntrl(c) && c < 128) {
             if (buf_len == buf_cap - 1) {
                 buf_cap *= 2;
@@ -1017,8 +5953,17 @@ char* editor_prompt(char* prompt, void (*callback)(char*, int)) {
     }
 }
 
+// Insert a bracketed paste in one go.
+void editor_paste(void) {
+    Append_Buf text = APPEND_BUF_INIT;
+    editor_read_paste(&text);
+
+    if (text.len > 0) editor_insert_text(text.b, text.len);
+    append_buf_free(&text);
+}
+
 void editor_move_cursor(int key_pressed) {
-    Editor_Row* row = (editor_state.cursor_y >= editor_state.rows_count) ? NULL : &editor_state.rows[editor_state.cursor_y];
+    Editor_Row* row = editor_row_at(editor_state.cursor_y);
 
     switch (key_pressed) {
         case MOVE_LEFT:
@@ -1026,7 +5971,7 @@ void editor_move_cursor(int key_pressed) {
                 editor_state.cursor_x -= 1;
             } else if (editor_state.cursor_y > 0) {
                 editor_state.cursor_y -= 1;
-                editor_state.cursor_x = editor_state.rows[editor_state.cursor_y].size;
+                editor_state.cursor_x = editor_row_at(editor_state.cursor_y)->size;
             }
             break;
         case MOVE_RIGHT:
@@ -1037,20 +5982,20 @@ void editor_move_cursor(int key_pressed) {
                 editor_state.cursor_x = 0;
             }
             break;
-        case MOVE_DOWN:
+        case MOVE_UP:
             if(editor_state.cursor_y != 0) {
                 editor_state.cursor_y -= 1;
             }
             break;
-        case MOVE_UP:
+        case MOVE_DOWN:
             if(editor_state.cursor_y < editor_state.rows_count) {
                 editor_state.cursor_y += 1;
             }
             break;
     }
 
-    row = (editor_state.cursor_y >= editor_state.rows_count) ? NULL : &editor_state.rows[editor_state.cursor_y];
-    int row_len = row ? row->size : 0;
+    row = editor_row_at(editor_state.cursor_y);
+    int64_t row_len = row ? row->size : 0;
     if(editor_state.cursor_x > row_len) {
         editor_state.cursor_x = row_len;
     }
@@ -1060,6 +6005,12 @@ void editor_move_cursor(int key_pressed) {
 void editor_process_keypress(void) {
     static int quit_times = EDITOR_QUIT_TIMES;
     int c = editor_read_key();
+    // Typing and deleting extend the undo step of the key before.
+    bool coalesce = false;
+    undo_key_start();
+    // Rows are loaded as far as the cursor can get with this key, so it never
+    // reaches the end of the rows before the end of the file.
+    line_index_load(editor_state.cursor_y + editor_state.screen_rows * 2 + 1);
 
     switch(c) {
         case CTRL_KEY('\r'):
@@ -1072,7 +6023,12 @@ void editor_process_keypress(void) {
                 quit_times -= 1;
                 return;
             }
+            if (buffers.count > 1) {
+                buffer_close();
+                break;
+            }
             editor_refresh_screen();
+            swap_discard();
             exit(0);
             break;
 
@@ -1086,7 +6042,7 @@ void editor_process_keypress(void) {
 
         case END_KEY:
             if(editor_state.cursor_y < editor_state.rows_count) {
-                editor_state.cursor_x = editor_state.rows[editor_state.cursor_y].size;
+                editor_state.cursor_x = editor_row_at(editor_state.cursor_y)->size;
             }
             break;
 
@@ -1094,11 +6050,46 @@ void editor_process_keypress(void) {
             editor_find();
             break;
 
+        case CTRL_KEY('o'):
+            {
+                char* filename = editor_prompt("Open: %s (ESC to cancel)", NULL);
+                if (filename) {
+                    buffer_open(filename);
+                    free(filename);
+                }
+            }
+            break;
+
+        case CTRL_KEY('b'):
+            if (buffers.count > 1) {
+                buffer_switch((buffers.current + 1) % buffers.count);
+            }
+            break;
+
+        case CTRL_KEY('e'):
+            line_index_load_all();
+            editor_state.cursor_y = editor_state.rows_count > 0 ? editor_state.rows_count - 1 : 0;
+            editor_state.cursor_x = 0;
+            break;
+
+        case CTRL_KEY('t'):
+            prof_toggle_overlay();
+            break;
+
+        case CTRL_KEY('z'):
+            editor_undo();
+            break;
+
+        case CTRL_KEY('y'):
+            editor_redo();
+            break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
             if(c == DEL_KEY) editor_move_cursor(MOVE_RIGHT);
             editor_del_char();
+            coalesce = true;
             break;
 
         case PAGE_UP:
@@ -1126,35 +6117,37 @@ void editor_process_keypress(void) {
             editor_move_cursor(c);
             break;
 
+        case PASTE_START:
+            editor_paste();
+            break;
+
         case CTRL_KEY('l'):
         case '\x1b':
             break;
 
         default:
             editor_insert_char(c);
+            coalesce = true;
             break;
     }
 
+    undo_key_end(coalesce);
     quit_times = EDITOR_QUIT_TIMES;
 }
 
 /*** init ***/
 
 void editor_init(void) {
-    editor_state.cursor_x        = 0;
-    editor_state.cursor_y        = 0;
-    editor_state.render_x        = 0;
-    editor_state.row_offset      = 0;
-    editor_state.col_offset      = 0;
-    editor_state.rows            = NULL;
-    editor_state.rows_count      = 0;
-    editor_state.dirty           = 0;
-    editor_state.filename        = NULL;
+    buffers.pager_defaults = pager;
+    buffer_add();
+
     editor_state.status_msg[0]   = '\0';
     editor_state.status_msg_time = 0;
-    editor_state.syntax          = NULL;
 
-    if(!get_window_size(&editor_state.screen_rows, &editor_state.screen_cols)) {
+    if (replay.enabled) {
+        editor_state.screen_rows = replay.rows;
+        editor_state.screen_cols = replay.cols;
+    } else if(!get_window_size(&editor_state.screen_rows, &editor_state.screen_cols)) {
         die("Error during editor init");
     }
 
@@ -1162,18 +6155,77 @@ void editor_init(void) {
 }
 
 int main(int argc, char* argv[]) {
-    enable_raw_mode();
+    // `--replay <script> [--size <rows>x<cols>]` runs headless, see
+    // `replay_start`. `--trace <file>` writes a trace, see `prof_trace_start`.
+    // `--pager` opens the file read-only in the pager whatever its size,
+    // `--cache <MB>` bounds the memory of the pager, see `pager_open`.
+    // `--fps <n>` caps the frames drawn a second.
+    char* replay_script = NULL;
+    char* replay_size   = NULL;
+    int arg = 1;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (strcmp(argv[arg], "--pager") == 0) {
+            pager.enabled = true;
+            arg += 1;
+            continue;
+        }
+
+        if (arg + 1 == argc) {
+            arg = 0;
+        } else if (strcmp(argv[arg], "--cache") == 0) {
+            pager.cache_max = (int64_t) atoi(argv[arg + 1]) << 20;
+        } else if (strcmp(argv[arg], "--replay") == 0) {
+            replay_script = argv[arg + 1];
+        } else if (strcmp(argv[arg], "--size") == 0) {
+            replay_size = argv[arg + 1];
+        } else if (strcmp(argv[arg], "--trace") == 0) {
+            prof_trace_start(argv[arg + 1]);
+        } else if (strcmp(argv[arg], "--fps") == 0) {
+            frame.fps_max = atoi(argv[arg + 1]);
+            if (frame.fps_max < 1) arg = 0;
+        } else {
+            arg = 0;
+        }
+        if (arg == 0) {
+            fprintf(stderr, "Usage: %s [--replay <script> [--size <rows>x<cols>]] [--trace <file>] [--fps <n>] [--pager] [--cache <MB>] [file...]\n", argv[0]);
+            exit(1);
+        }
+        arg += 2;
+    }
+
+    if (replay_script) {
+        replay_start(replay_script, replay_size);
+    } else {
+        enable_raw_mode();
+    }
     editor_init();
 
-    if (argc >= 2) {
-        editor_open(argv[1]);
+    enable_wake_events();
+
+    if (arg < argc) {
+        int64_t open_start = editor_now_us();
+        editor_open(argv[arg]);
+        replay.open_us = editor_now_us() - open_start;
+    }
+    // more files go in buffers of their own, the first one being shown.
+    if (arg + 1 < argc) {
+        for (int j = arg + 1; j < argc; j += 1) {
+            buffer_open(argv[j]);
+        }
+        buffer_switch(0);
     }
 
-    editor_set_status_msg("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    // a message from opening the file, like a recovery, goes first.
+    if (editor_state.status_msg[0] == '\0') {
+        editor_set_status_msg("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z/Y = undo/redo");
+    }
 
     while (1) {
         editor_refresh_screen();
-        editor_process_keypress();
+        // Keys that came in together are all handled before the next redraw.
+        do {
+            editor_process_keypress();
+        } while (editor_input_pending());
     }
 
     return 0;